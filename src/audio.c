@@ -7,10 +7,23 @@
 
 #include "nojoebuck.h"
 #include "audio.h"
+#include "pcm.h"
+#include "meter.h"
+#include "ring.h"
+#include "dsp.h"
+#include "convert.h"
+#include "feed.h"
+#include "trace.h"
+#include "recorder.h"
 
 #define HYSTERESIS  11  /* number of ms still considered in sync */
-#define CAPTURE_PTR(x) (((x)->buffer) + ((x)->cap * (x)->period_bytes))
-#define PLAY_PTR(x) (((x)->buffer) + ((x)->play * (x)->period_bytes))
+#define SEEK_MIN_MS 250 /* smallest delay change handled by seeking */
+#define XFADE_MS    10  /* length of crossfade at a seek splice */
+#define PERIOD_PTR(x, p) ring_period_ptr(x, p)
+#define CAPTURE_PTR(x) PERIOD_PTR(x, (x)->cap)
+#define PLAY_PTR(x) PERIOD_PTR(x, (x)->play)
+#define PREV_PLAY(x) ((((x)->play) ? (x)->play : (x)->mem_num_periods) - 1)
+#define PREV_PLAY_PTR(x) PERIOD_PTR(x, PREV_PLAY(x))
 
 static void advance_ptr(buffer_config_t *bc, unsigned int *ptr) {
   if (!bc || !ptr)
@@ -22,21 +35,198 @@ static void advance_ptr(buffer_config_t *bc, unsigned int *ptr) {
 }
 
 static void advance_play_ptr(buffer_config_t *bc) {
+  if (bc->quiet[bc->play]) {
+    bc->quiet_p--;
+  }
   advance_ptr(bc, &(bc->play));
+  ring_played(bc);
 }
 
 static void advance_cap_ptr(buffer_config_t *bc) {
-  return advance_ptr(bc, &(bc->cap));
+  if (bc->quiet[bc->cap]) {
+    bc->quiet_p++;
+  }
+  advance_ptr(bc, &(bc->cap));
+  ring_captured(bc);
+}
+
+/* number of periods buffered between the play and capture pointers */
+static unsigned int buffered_periods(buffer_config_t *bc) {
+  if (bc->cap >= bc->play) {
+    return bc->cap - bc->play;
+  }
+  return (bc->mem_num_periods - bc->play) + bc->cap;
 }
 
-static int write_playback_period(buffer_config_t *bc) {
+/*
+ * Periods (of capture time) queued in the ALSA playback buffer, rounded
+ * up.  The playback side may run at another rate and period size.
+ */
+static unsigned int play_queued_periods(buffer_config_t *bc) {
+  snd_pcm_sframes_t avail = snd_pcm_avail(bc->play_hndl);
+  uint64_t queued;
+
+  if ((avail < 0) || (avail >= bc->play_buffer_frames)) {
+    return 0;
+  }
+
+  queued = (uint64_t)(bc->play_buffer_frames - avail) * bc->rate;
+  return (queued + (uint64_t)bc->play_rate * bc->period_frames - 1) /
+         ((uint64_t)bc->play_rate * bc->period_frames);
+}
+
+/*
+ * Periods to write at once at normal speed: up to 'room' (left in the ALSA
+ * buffer) of those buffered, as long as they are contiguous in memory
+ */
+static unsigned int playback_periods(buffer_config_t *bc, unsigned int room) {
+  unsigned int n = buffered_periods(bc);
+
+  n = (n < room) ? n : room;
+  n = (n < RING_MAX_SPAN) ? n : RING_MAX_SPAN;
+  while ((n > 1) && !ring_span_ptr(bc, bc->play, n)) {
+    n--;
+  }
+  return (n > 1) ? n : 1;
+}
+
+/*
+ * Periods to read at once: those already waiting in the capture buffer (at
+ * least one, blocking for it) as long as they are contiguous in memory
+ */
+static unsigned int capture_periods(buffer_config_t *bc) {
+  snd_pcm_sframes_t avail = snd_pcm_avail_update(bc->cap_hndl);
+  unsigned int n = (avail > 0) ? avail / bc->period_frames : 1;
+
+  n = (n < RING_MAX_SPAN) ? n : RING_MAX_SPAN;
+  while ((n > 1) && !ring_span_ptr(bc, bc->cap, n)) {
+    n--;
+  }
+  return (n > 1) ? n : 1;
+}
+
+/*
+ * ALSA buffer fill (frames) as of the last capture and playback timestamps,
+ * for the trace.  Kept from the pointer updates done for the delay control
+ * anyway; querying ALSA for each trace event would cost a pointer sync
+ * (an ioctl where the status page isn't mapped, i.e. on the Pi)
+ */
+static long cap_fill = -1;
+static long play_fill = -1;
+
+static int write_frames(buffer_config_t *bc, uint8_t *audiodata, int dataframes) {
+  int err;
+  unsigned int frames;
+  uint64_t start = trace_now();
+
+  audiodata = dsp_process(bc, audiodata, dataframes);
+  audiodata = convert_process(bc, audiodata, dataframes, &frames);
+  trace_event(bc, TRACE_PROCESS, start, dataframes, -1);
+  dataframes = frames;
+  recorder_played(bc, audiodata, dataframes);
+  start = trace_now();
+  err = snd_pcm_writei(bc->play_hndl, audiodata, dataframes);
+  trace_event(bc, TRACE_WRITE, start, dataframes, play_fill);
+  if (err == -EPIPE) {
+    trace_xrun(bc, TRACE_UNDERRUN, -1);
+    if (CAN_PRINT(bc)) {
+      printf("Warning: playback buffer underrun.\n");
+    }
+    snd_pcm_prepare(bc->play_hndl);
+    err = 0;
+  } else if (err < 0) {
+    fprintf (stderr, "Write to audio interface failed (%s)\n", snd_strerror (err));
+  } else if (err != dataframes) {
+    fprintf(stderr, "Warning: only wrote %d/%d frames\n", err, dataframes);
+    err = -1;
+  } else {
+    err = 0;
+  }
+
+  return err;
+}
+
+static unsigned int xfade_frames(buffer_config_t *bc) {
+  return (bc->rate * XFADE_MS) / 1000;
+}
+
+/*
+ * Seek mode: jump the play pointer 'periods' periods forward and write
+ * one period which crossfades from the old position to the new one.
+ */
+static int seek_forward(buffer_config_t *bc, uint8_t *splice,
+                        unsigned int periods) {
+  uint8_t *from = PLAY_PTR(bc);
+  unsigned int skip;
+  int err;
+
+  pthread_mutex_lock(&bc->lock);
+  for (skip = 0; skip < periods; skip++) {
+    advance_play_ptr(bc);
+  }
+  pthread_mutex_unlock(&bc->lock);
+
+  pcm_crossfade(bc->format, bc->channels, splice, from, PLAY_PTR(bc),
+                bc->period_frames, xfade_frames(bc));
+  err = write_frames(bc, splice, bc->period_frames);
+  advance_play_ptr(bc);
+
+  return err;
+}
+
+/*
+ * Seek mode: write the current period faded out to silence.  The caller
+ * then inserts silent periods without advancing the play pointer.
+ */
+static int seek_fade_out(buffer_config_t *bc, uint8_t *splice) {
+  int err;
+
+  pcm_crossfade(bc->format, bc->channels, splice, PLAY_PTR(bc), NULL,
+                bc->period_frames, xfade_frames(bc));
+  err = write_frames(bc, splice, bc->period_frames);
+  advance_play_ptr(bc);
+
+  return err;
+}
+
+/* Seek mode: write the current period faded in from silence */
+static int seek_fade_in(buffer_config_t *bc, uint8_t *splice) {
+  int err;
+
+  pcm_crossfade(bc->format, bc->channels, splice, NULL, PLAY_PTR(bc),
+                bc->period_frames, xfade_frames(bc));
+  err = write_frames(bc, splice, bc->period_frames);
+  advance_play_ptr(bc);
+
+  return err;
+}
+
+/*
+ * Silence aware fill: write the previous (quiet) period again, spliced in
+ * from the current (also quiet) one.  The play pointer is not advanced so
+ * one period of delay is added.
+ */
+static int repeat_quiet_period(buffer_config_t *bc, uint8_t *splice) {
+  pcm_crossfade(bc->format, bc->channels, splice, PLAY_PTR(bc),
+                PREV_PLAY_PTR(bc), bc->period_frames, xfade_frames(bc));
+  return write_frames(bc, splice, bc->period_frames);
+}
+
+/*
+ * Write 'periods' periods from the play pointer (more than one only at
+ * normal speed, see playback_periods()).  The play pointer isn't advanced.
+ */
+static int write_playback_period(buffer_config_t *bc, unsigned int periods) {
   int err;
   float src_frame;
   int dst_frame;
   float target_frame = 0;
   uint8_t *audiodata = NULL;
   uint8_t *buf = NULL;
+  uint8_t *src = ring_span_ptr(bc, bc->play, periods);
+  uint8_t *silence = NULL;
   int dataframes;
+  uint64_t start;
 
   /*
    *  bc->state enums map to playback rates where PLAY is the denominator i.e.:
@@ -51,10 +241,20 @@ static int write_playback_period(buffer_config_t *bc) {
   /* rate at which frames should be duplicated (used for slowing down playback) */
   float frame_dup = (bc->state < PLAY) ? 1.0 / playback_rate : 1;
 
+  /* period not read back from the spill file in time; play silence */
+  if (!src) {
+    fprintf(stderr, "Warning: period %d not available for playback\n", bc->play);
+    src = silence = calloc(1, bc->period_bytes);
+    if (!src) {
+      fprintf(stderr, "%s() Memory error\n", __func__);
+      return -ENOMEM;
+    }
+  }
+
   if (bc->state == PLAY) {
     /* no copy needed for regular speed playback */
-    dataframes = bc->period_frames;
-    audiodata = PLAY_PTR(bc);
+    dataframes = periods * bc->period_frames;
+    audiodata = src;
   } else {
     /* create a data buffer which is stretched/compressed based on state */
     dataframes = (int)((float) bc->period_frames * (1.0 / playback_rate) + 0.5);
@@ -63,10 +263,12 @@ static int write_playback_period(buffer_config_t *bc) {
     //       playback_rate, STATE_NAME(bc->state), frame_skip, frame_dup,
     //       bc->period_frames, bc->period_frames * bc->frame_bytes,
     //       dataframes, dataframes * bc->frame_bytes);
+    start = trace_now();
     buf = malloc(dataframes * bc->frame_bytes);
     audiodata = buf;
     if (!audiodata) {
       fprintf(stderr, "%s() Memory error\n", __func__);
+      free(silence);
       return -ENOMEM;
     }
 
@@ -77,53 +279,127 @@ static int write_playback_period(buffer_config_t *bc) {
         //printf("  source frame %d (%.3f) -> dst frame %d  [target: %.3f]\n",
         //       (int)src_frame, src_frame, dst_frame, target_frame);
         memcpy(&(audiodata[dst_frame * bc->frame_bytes]),
-               PLAY_PTR(bc) + (((int)src_frame) * bc->frame_bytes),
+               src + (((int)src_frame) * bc->frame_bytes),
                bc->frame_bytes);
         dst_frame++;
       }
       src_frame += frame_skip;
     }
+    trace_event(bc, TRACE_STRETCH, start, dataframes, -1);
   }
 
-  err = snd_pcm_writei(bc->play_hndl, audiodata, dataframes);
-  if (err == -EPIPE) {
-    printf("Warning: playback buffer underrun.\n");
-    snd_pcm_prepare(bc->play_hndl);
-    err = 0;
-  } else if (err < 0) {
-    fprintf (stderr, "Write to audio interface failed (%s)\n", snd_strerror (err));
-  } else if (err != dataframes) {
-    fprintf(stderr, "Warning: only wrote %d/%ld frames\n", err, bc->period_frames);
-    err = -1;
-  } else {
-    err = 0;
-  }
+  err = write_frames(bc, audiodata, dataframes);
 
   if (buf) {
     free(buf);
   }
+  free(silence);
   return err;
 }
 
-/* get actual delta in periods */
-unsigned int get_actual_delta(buffer_config_t *bc)
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * ALSA timestamp of the last hardware pointer update and the frames
+ * available at that point.  Falls back to the current time if the driver
+ * doesn't timestamp.
+ */
+static uint64_t pcm_htimestamp(snd_pcm_t *hndl, snd_pcm_uframes_t *avail) {
+  snd_htimestamp_t ts;
+
+  if ((snd_pcm_htimestamp(hndl, avail, &ts) < 0) ||
+      (!ts.tv_sec && !ts.tv_nsec)) {
+    snd_pcm_sframes_t a = snd_pcm_avail(hndl);
+    *avail = (a > 0) ? a : 0;
+    return mono_ns();
+  }
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* CLOCK_MONOTONIC time the first frame of the 'periods' periods just read
+ * was captured */
+static uint64_t captured_ns(buffer_config_t *bc, unsigned int periods) {
+  snd_pcm_uframes_t avail;
+  uint64_t ts;
+
+  if (bc->feed) {
+    return feed_captured_ns(bc);
+  }
+
+  ts = pcm_htimestamp(bc->cap_hndl, &avail);
+  cap_fill = avail;
+
+  return ts - ((avail + (uint64_t)periods * bc->period_frames) * 1000000000ULL) /
+              bc->rate;
+}
+
+/* CLOCK_MONOTONIC time the next frame written for playback will be heard */
+static uint64_t playout_ns(buffer_config_t *bc) {
+  snd_pcm_uframes_t avail;
+  uint64_t ts = pcm_htimestamp(bc->play_hndl, &avail);
+  snd_pcm_uframes_t queued;
+
+  queued = (avail < bc->play_buffer_frames) ? bc->play_buffer_frames - avail : 0;
+  play_fill = queued;
+  return ts + (queued * 1000000000ULL) / bc->play_rate;
+}
+
+/* capture time of period idx, or when it will be captured if it hasn't
+ * been yet (the buffer is empty).  Call with the lock held */
+static uint64_t period_cap_ns(buffer_config_t *bc, unsigned int idx) {
+  unsigned int last = (bc->cap ? bc->cap : bc->mem_num_periods) - 1;
+
+  if (idx == bc->cap) {
+    return bc->cap_ns[last] + (uint64_t)bc->period_time * 1000;
+  }
+  return bc->cap_ns[idx];
+}
+
+/*
+ * Actual delay in uS: how long ago the audio about to be written (after
+ * 'silence_p' periods of inserted silence) was captured by the time it's
+ * heard.  Based on capture and playback timestamps so it stays exact
+ * across xruns, dropped reads and rate conversion.
+ */
+static int64_t actual_delay_us(buffer_config_t *bc, unsigned int silence_p) {
+  uint64_t out = playout_ns(bc) + (uint64_t)silence_p * bc->period_time * 1000;
+  uint64_t cap;
+  uint64_t start = trace_now();
+
+  pthread_mutex_lock(&bc->lock);
+  trace_event(bc, TRACE_LOCK, start, 0, -1);
+  if (!bc->cap_count) {
+    pthread_mutex_unlock(&bc->lock);
+    return 0;
+  }
+  cap = period_cap_ns(bc, bc->play);
+  pthread_mutex_unlock(&bc->lock);
+
+  return ((int64_t)out - (int64_t)cap) / 1000;
+}
+
+/* get actual delay in uS */
+int64_t get_actual_delay_us(buffer_config_t *bc)
 {
-  /* number of periods in ALSA playback buffer */
-  unsigned int delta = bc->alsa_num_periods - snd_pcm_avail(bc->play_hndl) / bc->period_frames;
   if (!bc) {
     fprintf(stderr, "%s(): Invalid call\n", __func__);  
     return 0;
   }
 
-  pthread_mutex_lock(&bc->lock);
-  if (bc->cap >= bc->play) {
-    delta +=  bc->cap - bc->play;
-  } else {
-    delta += (bc->mem_num_periods - bc->play) + bc->cap;
-  }
-  pthread_mutex_unlock(&bc->lock);
+  return actual_delay_us(bc, 0);
+}
 
-  return delta;
+/* get actual delta in periods */
+unsigned int get_actual_delta(buffer_config_t *bc)
+{
+  int64_t us = get_actual_delay_us(bc);
+
+  return (us > 0) ? (us + bc->period_time / 2) / bc->period_time : 0;
 }
 
 void *audio_io_thread(void *ptr) {
@@ -131,30 +407,102 @@ void *audio_io_thread(void *ptr) {
   buffer_config_t *bc = (buffer_config_t *)ptr;
   int last_state = STOP;
   struct timeval initial_time, now_time;
-  int actual_delta_p;
+  int64_t actual_us = 0;
   int time_off_ms;
   unsigned int period;
+  unsigned int seek_p;
+  unsigned int silence_p = 0;  /* seek mode: silent periods left to insert */
+  bool fade_in = false;        /* seek mode: fade in after inserted silence */
+  bool repeated = false;       /* last write repeated a quiet period */
+  unsigned int need_p;
+  unsigned int io_p;           /* periods read or written in one call */
+  unsigned int i;
+  uint64_t cap_ns;
+  uint64_t start;
+  meter_levels_t levels;
+  uint8_t *splice;
+
+  /* scratch period used to build seek crossfades and silence */
+  splice = malloc(bc->period_bytes);
+  if (!splice) {
+    fprintf(stderr, "%s() Memory error\n", __func__);
+    return NULL;
+  }
 
   gettimeofday(&initial_time, NULL);
 
   while (bc->state) {
-    actual_delta_p = get_actual_delta(bc);
-    time_off_ms = ((int)((bc->target_delta_p - actual_delta_p) * bc->period_time)) / 1000;
-
-    /* Blocking read from capture interface (provies throttle to while loop) */
-    if ((err = snd_pcm_readi(bc->cap_hndl, CAPTURE_PTR(bc), bc->period_frames))
-        != bc->period_frames) {
+    /* Blocking read from capture interface (provies throttle to while loop)
+     * or from the audio written to the ALSA plugin.  Periods which piled up
+     * in the capture buffer are read in one call */
+    start = trace_now();
+    if (bc->feed) {
+      io_p = 1;
+      err = feed_read(bc, CAPTURE_PTR(bc));
+      trace_event(bc, TRACE_READ, start, err, -1);
+    } else {
+      io_p = capture_periods(bc);
+      err = snd_pcm_readi(bc->cap_hndl, ring_span_ptr(bc, bc->cap, io_p),
+                          io_p * bc->period_frames);
+      trace_event(bc, TRACE_READ, start, (err > 0) ? err : 0, cap_fill);
+    }
+    if (err != io_p * bc->period_frames) {
+      if (err == -EPIPE) {
+        trace_xrun(bc, TRACE_OVERRUN, -1);
+      }
       fprintf (stderr, "Read from audio interface failed (%s)\n", snd_strerror (err));
+      /* overrun: restart capture; the timestamps account for the gap */
+      if ((err < 0) && bc->cap_hndl) {
+        snd_pcm_recover(bc->cap_hndl, err, 1);
+      }
       continue;
     }
+    cap_ns = captured_ns(bc, io_p);
+
+    for (i = 0; i < io_p; i++) {
+      bc->cap_ns[bc->cap] = cap_ns +
+          ((uint64_t)i * bc->period_frames * 1000000000ULL) / bc->rate;
+
+      /* Measure levels of the new period in one pass for quiet detection & UI */
+      meter_period(bc->format, bc->channels, CAPTURE_PTR(bc), bc->period_frames,
+                   &levels);
+      if (bc->quiet_energy) {
+        bc->quiet[bc->cap] = (meter_energy(&levels, bc->channels) <
+                              bc->quiet_energy);
+      }
+      advance_cap_ptr(bc);
+
+      /* Publish the new period to the UI meters and network output */
+      pthread_mutex_lock(&bc->lock);
+      meter_accumulate(&bc->levels, &levels, bc->channels);
+      meter_accumulate(&bc->levels_query, &levels, bc->channels);
+      bc->cap_count++;
+      pthread_cond_broadcast(&bc->captured);
+      pthread_mutex_unlock(&bc->lock);
+    }
 
-    advance_cap_ptr(bc);
+    /*
+     * Target audio captured 'delay' ago by the time it's heard.  Silence
+     * still queued by a seek will add to the delay.
+     */
+    actual_us = actual_delay_us(bc, silence_p);
+    time_off_ms = ((int64_t)bc->target_delay_us - actual_us) / 1000;
 
     /* Loop from: # of periods currently in the ALSA playback buffer 
      * to PERIODS_IN_ALSABUF
      */
-    for (period = bc->alsa_num_periods -  snd_pcm_avail(bc->play_hndl) / bc->period_frames;
-         period < PERIODS_IN_ALSABUF; period++) {
+    for (period = play_queued_periods(bc); period < PERIODS_IN_ALSABUF;
+         period++) {
+
+      /* Seek mode: play out any inserted silence before resuming */
+      if (silence_p) {
+        memset(splice, 0, bc->period_bytes);
+        write_frames(bc, splice, bc->period_frames);
+        if (--silence_p == 0) {
+          fade_in = true;
+        }
+        continue;
+      }
  
       /* Give up if we're out of frames to send */
       if (bc->play == bc->cap) {
@@ -163,6 +511,62 @@ void *audio_io_thread(void *ptr) {
         break;
       }
 
+      if (fade_in) {
+        seek_fade_in(bc, splice);
+        fade_in = false;
+        continue;
+      }
+
+      /*
+       *  Seek mode: rather than changing speed, splice the play pointer
+       *  forward (to reduce delay) or insert silence (to increase delay)
+       */
+      if (bc->seek && abs(time_off_ms) >= SEEK_MIN_MS) {
+        seek_p = ((uint64_t)abs(time_off_ms) * 1000) / bc->period_time;
+        bc->state = PLAY;
+        if (time_off_ms < 0) {
+          if (seek_p >= buffered_periods(bc)) {
+            seek_p = buffered_periods(bc) - 1;
+          }
+          seek_forward(bc, splice, seek_p);
+        } else {
+          seek_fade_out(bc, splice);
+          silence_p = seek_p;
+        }
+        time_off_ms = 0;
+        continue;
+      }
+
+      /*
+       *  Silence aware catch-up: if enough quiet periods are buffered to
+       *  make up the difference, change the delay by dropping or repeating
+       *  those instead of changing the playback speed
+       */
+      need_p = ((uint64_t)abs(time_off_ms) * 1000) / bc->period_time;
+      if (bc->quiet_energy && (abs(time_off_ms) >= HYSTERESIS) &&
+          (bc->quiet_p >= need_p)) {
+        bc->state = PLAY;
+        if ((time_off_ms < 0) && bc->quiet[bc->play] &&
+            (buffered_periods(bc) > 1)) {
+          seek_forward(bc, splice, 1);
+          time_off_ms += bc->period_time / 1000;
+          continue;
+        } else if ((time_off_ms > 0) && !repeated && bc->quiet[bc->play] &&
+                   bc->quiet[PREV_PLAY(bc)]) {
+          repeat_quiet_period(bc, splice);
+          time_off_ms -= bc->period_time / 1000;
+          repeated = true;
+          continue;
+        }
+        /* not quiet here; play normally until the next quiet period */
+        if (write_playback_period(bc, 1) == 0) {
+          advance_play_ptr(bc);
+        }
+        repeated = false;
+        continue;
+      }
+      repeated = false;
+
       if (time_off_ms < -5000) {
         bc->state = PURGE_32_8;
       } else if (time_off_ms < -1500) {
@@ -187,38 +591,46 @@ void *audio_io_thread(void *ptr) {
 
       /*
        *  Write one period to playback interface either streched,
-       *  normal or compressed based on state
+       *  normal or compressed based on state.  At normal speed the periods
+       *  up to PERIODS_IN_ALSABUF are written at once when contiguous
        */
-      if (write_playback_period(bc) != 0) {
+      io_p = (bc->state == PLAY) ?
+             playback_periods(bc, PERIODS_IN_ALSABUF - period) : 1;
+      if (write_playback_period(bc, io_p) != 0) {
         continue;
       } 
-      advance_play_ptr(bc);
+      for (i = 0; i < io_p; i++) {
+        advance_play_ptr(bc);
+      }
+      period += io_p - 1;
     }
 
-    if ((last_state != bc->state) || bc->verbose) {
+    if (((last_state != bc->state) && CAN_PRINT(bc)) || bc->verbose) {
       long delta_us;
       gettimeofday(&now_time, NULL);
       delta_us = (now_time.tv_sec - initial_time.tv_sec) * 1000000 +
                  ((int)now_time.tv_usec - (int)initial_time.tv_usec);
       printf("%8.03f  STATE: %-10.10s CAP: %-4d  PLAY: %-4d  DELAY: %3.3f  "
-             "DELTA: %4d/%-4d  ALSABUF: %ld/%d\n",
+             "DELTA: %4lld/%-4d ms  ALSABUF: %d/%d\n",
              delta_us / 1000000.0, STATE_NAME(bc->state), bc->cap, bc->play,
-             (bc->target_delta_p * bc->period_time) / 1000000.0, actual_delta_p,
-             bc->target_delta_p,
-             bc->alsa_num_periods -  snd_pcm_avail(bc->play_hndl) / bc->period_frames,
-	     PERIODS_IN_ALSABUF);
+             bc->target_delay_us / 1000000.0, (long long)(actual_us / 1000),
+             (int)(bc->target_delay_us / 1000),
+             play_queued_periods(bc), PERIODS_IN_ALSABUF);
     }
     last_state = bc->state;
   }
 
+  free(splice);
   return NULL;
 }
 
 int configure_stream(snd_pcm_t *handle, int format, unsigned int rate,
-                     unsigned int *actual_rate, unsigned int *period_us,
+                     unsigned int channels, unsigned int *actual_rate,
+                     unsigned int *period_us,
                      snd_pcm_uframes_t *period_frames, unsigned int *alsa_num_periods) {
   int dir, err = -1;
   snd_pcm_hw_params_t *hw_params;
+  snd_pcm_sw_params_t *sw_params = NULL;
 
   if (!handle || !actual_rate || !period_us || !alsa_num_periods) {
     fprintf(stderr, "Invalid call to configure stream\n");
@@ -255,7 +667,7 @@ int configure_stream(snd_pcm_t *handle, int format, unsigned int rate,
   }
   *actual_rate = rate;
 
-  if ((err = snd_pcm_hw_params_set_channels(handle, hw_params, 2)) < 0) {
+  if ((err = snd_pcm_hw_params_set_channels(handle, hw_params, channels)) < 0) {
     fprintf(stderr, "cannot set channel count (%s)\n", snd_strerror(err));
     goto exit;
   }
@@ -275,7 +687,21 @@ int configure_stream(snd_pcm_t *handle, int format, unsigned int rate,
   snd_pcm_hw_params_get_period_size(hw_params, period_frames, &dir);
   snd_pcm_hw_params_get_periods(hw_params, alsa_num_periods, &dir);
 
+  /* monotonic timestamps for snd_pcm_htimestamp() (delay is kept in time) */
+  if ((snd_pcm_sw_params_malloc(&sw_params) < 0) ||
+      (snd_pcm_sw_params_current(handle, sw_params) < 0) ||
+      (snd_pcm_sw_params_set_tstamp_mode(handle, sw_params,
+                                         SND_PCM_TSTAMP_ENABLE) < 0) ||
+      (snd_pcm_sw_params_set_tstamp_type(handle, sw_params,
+                                         SND_PCM_TSTAMP_TYPE_MONOTONIC) < 0) ||
+      (snd_pcm_sw_params(handle, sw_params) < 0)) {
+    fprintf(stderr, "Warning: no audio timestamps; using system time\n");
+  }
+
 exit:
   snd_pcm_hw_params_free (hw_params);
+  if (sw_params) {
+    snd_pcm_sw_params_free (sw_params);
+  }
   return err;
 }
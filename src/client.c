@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <zmq.h>
+
+#include "nojoebuck-client.h"
+
+/*
+ * libnojoebuck-client
+ *
+ * Small client side of the UI protocol (see ui-server.c for the messages).
+ * Waits are done in zmq_poll() so UIs sleep until there's something to
+ * show, and delay changes are coalesced so fast encoder turns don't flood
+ * the server.  Built as a shared library for C UIs and for the Python
+ * binding in ui/nojoebuck_client.py.
+ *
+ * The tap functions map the delay buffer shared by nojoebuck --tap (see
+ * tap.c); they don't use ZMQ at all.
+ */
+
+#define NJB_LINGER_MS 100  /* time to deliver queued commands on close */
+
+struct njb_tap {
+  const uint8_t *map;
+  size_t map_bytes;
+  const njb_tap_header_t *hdr;
+};
+
+struct njb {
+  void *ctx;
+  void *cmd;
+  void *status;
+  int wake_fd;
+  int pending_delay;         /* delay waiting to be sent or -1 */
+  uint64_t last_delay_ms;    /* time the last delay was sent */
+  unsigned int level_ms;     /* level period to keep renewing or 0 */
+  uint64_t last_level_ms;    /* time the level period was last sent */
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int send_msg(njb_t *njb, const char *msg) {
+  int len = strlen(msg);
+
+  /* the server ignores anything longer */
+  if (len > NJB_MAX_MSG) {
+    return -EMSGSIZE;
+  }
+
+  /* don't block if the server isn't there to take it */
+  if (zmq_send(njb->cmd, msg, len, ZMQ_DONTWAIT) != len) {
+    return -errno;
+  }
+  return 0;
+}
+
+static int send_delay(njb_t *njb, unsigned int delay_ms) {
+  char msg[NJB_MAX_MSG];
+
+  snprintf(msg, sizeof(msg), "D:%u", delay_ms);
+  njb->pending_delay = -1;
+  njb->last_delay_ms = now_ms();
+  return send_msg(njb, msg);
+}
+
+/* ms until the pending delay is due, -1 if nothing pending */
+static int delay_due_ms(njb_t *njb) {
+  uint64_t due;
+
+  if (njb->pending_delay < 0) {
+    return -1;
+  }
+
+  due = njb->last_delay_ms + NJB_COALESCE_MS;
+  return (due > now_ms()) ? (int)(due - now_ms()) : 0;
+}
+
+/* ms until the level period lease should be renewed, or -1 if none */
+static int level_due_ms(njb_t *njb) {
+  uint64_t due;
+
+  if (!njb->level_ms) {
+    return -1;
+  }
+
+  due = njb->last_level_ms + NJB_LEVEL_LEASE_MS / 2;
+  return (due > now_ms()) ? (int)(due - now_ms()) : 0;
+}
+
+static int send_level_period(njb_t *njb) {
+  char msg[NJB_MAX_MSG];
+
+  njb->last_level_ms = now_ms();
+  snprintf(msg, sizeof(msg), "L:%u", njb->level_ms);
+  return send_msg(njb, msg);
+}
+
+/*
+ * External Interface Functions
+ */
+njb_t *njb_open(const char *cmd_endpoint, const char *status_endpoint) {
+  njb_t *njb;
+  int linger = NJB_LINGER_MS;
+
+  if (!cmd_endpoint) {
+    cmd_endpoint = getenv("NOJOEBUCK_CMD");
+    cmd_endpoint = cmd_endpoint ? cmd_endpoint : NJB_CMD_ENDPOINT;
+  }
+  if (!status_endpoint) {
+    status_endpoint = getenv("NOJOEBUCK_STATUS");
+    status_endpoint = status_endpoint ? status_endpoint : NJB_STATUS_ENDPOINT;
+  }
+
+  njb = calloc(1, sizeof(*njb));
+  if (!njb) {
+    return NULL;
+  }
+  njb->wake_fd = -1;
+  njb->pending_delay = -1;
+
+  njb->ctx = zmq_ctx_new();
+  if (!njb->ctx) {
+    goto fail;
+  }
+
+  njb->cmd = zmq_socket(njb->ctx, ZMQ_PUSH);
+  njb->status = zmq_socket(njb->ctx, ZMQ_SUB);
+  if (!njb->cmd || !njb->status) {
+    goto fail;
+  }
+  zmq_setsockopt(njb->cmd, ZMQ_LINGER, &linger, sizeof(linger));
+
+  if (zmq_connect(njb->cmd, cmd_endpoint) ||
+      zmq_connect(njb->status, status_endpoint)) {
+    goto fail;
+  }
+
+  return njb;
+
+fail:
+  fprintf(stderr, "Could not connect to nojoebuck: %s\n", zmq_strerror(errno));
+  njb_close(njb);
+  return NULL;
+}
+
+void njb_close(njb_t *njb) {
+  if (!njb) {
+    return;
+  }
+
+  njb_flush(njb);
+  if (njb->cmd) {
+    zmq_close(njb->cmd);
+  }
+  if (njb->status) {
+    zmq_close(njb->status);
+  }
+  if (njb->ctx) {
+    zmq_ctx_destroy(njb->ctx);
+  }
+  free(njb);
+}
+
+int njb_subscribe(njb_t *njb, const char *topics) {
+  char topic[2] = { 0, 0 };
+
+  if (!*topics) {
+    return zmq_setsockopt(njb->status, ZMQ_SUBSCRIBE, "", 0) ? -errno : 0;
+  }
+
+  for (; *topics; topics++) {
+    topic[0] = *topics;
+    if (zmq_setsockopt(njb->status, ZMQ_SUBSCRIBE, topic, 1)) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+int njb_set_delay(njb_t *njb, unsigned int delay_ms) {
+  if (now_ms() - njb->last_delay_ms >= NJB_COALESCE_MS) {
+    return send_delay(njb, delay_ms);
+  }
+
+  /* sent by the next wait/flush once due */
+  njb->pending_delay = delay_ms;
+  return 0;
+}
+
+/* send any delay change held back by coalescing now */
+int njb_flush(njb_t *njb) {
+  if (njb->pending_delay < 0) {
+    return 0;
+  }
+  return send_delay(njb, njb->pending_delay);
+}
+
+int njb_query(njb_t *njb, njb_topic_t topic) {
+  char msg[3] = { topic, ':', 0 };
+
+  return send_msg(njb, msg);
+}
+
+/* 0 stops renewing; the server drops the period when its lease lapses */
+int njb_set_level_period(njb_t *njb, unsigned int period_ms) {
+  njb->level_ms = period_ms;
+  if (!period_ms) {
+    return 0;
+  }
+  return send_level_period(njb);
+}
+
+int njb_set_rate_limit(njb_t *njb, unsigned int period_ms) {
+  char msg[NJB_MAX_MSG];
+
+  snprintf(msg, sizeof(msg), "U:%u", period_ms);
+  return send_msg(njb, msg);
+}
+
+int njb_command(njb_t *njb, const char *cmd) {
+  return send_msg(njb, cmd);
+}
+
+void njb_set_wake_fd(njb_t *njb, int fd) {
+  njb->wake_fd = fd;
+}
+
+int njb_parse(const char *msg, int len, njb_status_t *status) {
+  char *p, *end;
+
+  memset(status, 0, sizeof(*status));
+  if ((len < 2) || (msg[1] != ':')) {
+    return -EINVAL;
+  }
+  if (len > NJB_MAX_MSG + 2) {
+    len = NJB_MAX_MSG + 2;
+  }
+
+  status->topic = msg[0];
+  memcpy(status->text, msg + 2, len - 2);
+  status->text[len - 2] = '\0';
+  status->value = strtol(status->text, NULL, 10);
+
+  if (status->topic == NJB_LEVELS) {
+    for (p = status->text; *p && (status->num_levels < NJB_MAX_LEVELS);) {
+      status->levels[status->num_levels++] = strtol(p, &end, 10);
+      if (end == p) {
+        break;
+      }
+      p = (*end == ',') ? end + 1 : end;
+    }
+  }
+
+  return 0;
+}
+
+int njb_wait(njb_t *njb, int timeout_ms, njb_status_t *status) {
+  zmq_pollitem_t items[2] = {
+    { njb->status, 0, ZMQ_POLLIN, 0 },
+    { NULL, njb->wake_fd, ZMQ_POLLIN, 0 },
+  };
+  char msg[NJB_MAX_MSG + 2];
+  uint64_t start = now_ms();
+  int wait, due, len;
+
+  for (;;) {
+    /* wake up early to send a coalesced delay change or renew the level
+     * period */
+    wait = timeout_ms;
+    if (timeout_ms >= 0) {
+      wait -= (int)(now_ms() - start);
+      wait = (wait < 0) ? 0 : wait;
+    }
+    due = delay_due_ms(njb);
+    if ((due >= 0) && ((wait < 0) || (due < wait))) {
+      wait = due;
+    }
+    due = level_due_ms(njb);
+    if ((due >= 0) && ((wait < 0) || (due < wait))) {
+      wait = due;
+    }
+
+    if (zmq_poll(items, (njb->wake_fd >= 0) ? 2 : 1, wait) < 0) {
+      if (errno == EINTR) {
+        return 0;
+      }
+      return -errno;
+    }
+
+    if (delay_due_ms(njb) == 0) {
+      njb_flush(njb);
+    }
+    if (level_due_ms(njb) == 0) {
+      send_level_period(njb);
+    }
+
+    if (items[0].revents & ZMQ_POLLIN) {
+      len = zmq_recv(njb->status, msg, sizeof(msg), ZMQ_DONTWAIT);
+      if ((len >= 0) && (njb_parse(msg, len, status) == 0)) {
+        return 1;
+      }
+      continue;
+    }
+
+    if (items[1].revents & ZMQ_POLLIN) {
+      return 0;
+    }
+
+    if ((timeout_ms >= 0) && (now_ms() - start >= (uint64_t)timeout_ms)) {
+      return 0;
+    }
+  }
+}
+
+int njb_dispatch(njb_t *njb, int timeout_ms, njb_callback_t cb, void *ctx) {
+  njb_status_t status;
+  int ret, count = 0;
+
+  ret = njb_wait(njb, timeout_ms, &status);
+  while (ret > 0) {
+    cb(&status, ctx);
+    count++;
+    ret = njb_wait(njb, 0, &status);
+  }
+
+  return (ret < 0) ? ret : count;
+}
+
+/* receive the buffer's descriptor from the server */
+static int recv_fd(int sock) {
+  char msg[8];
+  char ctrl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { .iov_base = msg, .iov_len = sizeof(msg) };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctrl,
+    .msg_controllen = sizeof(ctrl),
+  };
+  struct cmsghdr *cm;
+  int fd;
+
+  if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) <= 0) {
+    return -1;
+  }
+  cm = CMSG_FIRSTHDR(&mh);
+  if (!cm || (cm->cmsg_level != SOL_SOCKET) || (cm->cmsg_type != SCM_RIGHTS)) {
+    return -1;
+  }
+  memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+  return fd;
+}
+
+njb_tap_t *njb_tap_open(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  njb_tap_header_t hdr;
+  njb_tap_t *tap;
+  int sock, fd;
+  off_t size;
+
+  path = path ? path : NJB_TAP_PATH;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+
+  sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return NULL;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "Could not connect to nojoebuck tap %s: %s\n", path,
+            strerror(errno));
+    close(sock);
+    return NULL;
+  }
+  fd = recv_fd(sock);
+  close(sock);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  /* the header describes the rest of the mapping */
+  size = lseek(fd, 0, SEEK_END);
+  if ((pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+      (hdr.magic != NJB_TAP_MAGIC) || (hdr.version != NJB_TAP_VERSION) ||
+      (size < hdr.header_bytes + (off_t)hdr.num_periods * hdr.period_bytes)) {
+    fprintf(stderr, "Unsupported nojoebuck tap\n");
+    close(fd);
+    return NULL;
+  }
+
+  tap = calloc(1, sizeof(*tap));
+  if (!tap) {
+    close(fd);
+    return NULL;
+  }
+  tap->map_bytes = size;
+  tap->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (tap->map == MAP_FAILED) {
+    free(tap);
+    return NULL;
+  }
+  tap->hdr = (const njb_tap_header_t *)tap->map;
+
+  return tap;
+}
+
+void njb_tap_close(njb_tap_t *tap) {
+  if (!tap) {
+    return;
+  }
+  munmap((void *)tap->map, tap->map_bytes);
+  free(tap);
+}
+
+const njb_tap_header_t *njb_tap_header(njb_tap_t *tap) {
+  return tap->hdr;
+}
+
+uint64_t njb_tap_captured(njb_tap_t *tap) {
+  return __atomic_load_n(&tap->hdr->cap_seq, __ATOMIC_ACQUIRE);
+}
+
+int njb_tap_valid(njb_tap_t *tap, uint64_t seq) {
+  uint64_t cap_seq = njb_tap_captured(tap);
+
+  return (seq < cap_seq) &&
+         (cap_seq - seq < tap->hdr->num_periods - tap->hdr->write_ahead);
+}
+
+const uint8_t *njb_tap_period(njb_tap_t *tap, uint64_t seq) {
+  if (!njb_tap_valid(tap, seq)) {
+    return NULL;
+  }
+  return tap->map + tap->hdr->header_bytes +
+         (size_t)(seq % tap->hdr->num_periods) * tap->hdr->period_bytes;
+}
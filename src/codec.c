@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <alsa/asoundlib.h>
+
+#include "codec.h"
+#include "pcm.h"
+
+#define MAX_CHANNELS  8
+#define MAX_ORDER     3
+#define RICE_BITS     5         /* bits used to code a Rice parameter */
+#define RICE_ESCAPE   31        /* Rice parameter meaning "raw residuals" */
+#define MAX_UNARY     40        /* longest unary code before escaping */
+
+/*
+ * Block layout (bit stream, MSB first):
+ *   1 bit    stereo is coded as left/side
+ *   per channel:
+ *     2 bits   predictor order
+ *     order x  warm-up samples (sample bits + 1)
+ *     per partition:
+ *       5 bits   Rice parameter (31 = escape: 6 bit width then raw values)
+ *       residuals
+ */
+
+typedef struct bitwriter {
+  uint8_t *buf;
+  size_t size;
+  size_t pos;       /* bytes written */
+  uint64_t acc;     /* pending bits (right aligned) */
+  unsigned int bits;
+  bool overflow;
+} bitwriter_t;
+
+typedef struct bitreader {
+  const uint8_t *buf;
+  size_t size;
+  size_t pos;
+  uint64_t acc;
+  unsigned int bits;
+} bitreader_t;
+
+static void put_bits(bitwriter_t *bw, uint32_t value, unsigned int bits) {
+  if (!bits)
+    return;
+  bw->acc = (bw->acc << bits) | (value & ((bits == 32) ? 0xffffffff :
+                                          ((1U << bits) - 1)));
+  bw->bits += bits;
+  while (bw->bits >= 8) {
+    bw->bits -= 8;
+    if (bw->pos < bw->size)
+      bw->buf[bw->pos++] = bw->acc >> bw->bits;
+    else
+      bw->overflow = true;
+  }
+}
+
+/* values wider than 32 bits (side channel and residuals of 32-bit audio) */
+static void put_bits64(bitwriter_t *bw, uint64_t value, unsigned int bits) {
+  if (bits > 32) {
+    put_bits(bw, value >> 32, bits - 32);
+    bits = 32;
+  }
+  put_bits(bw, (uint32_t)value, bits);
+}
+
+static void put_unary(bitwriter_t *bw, unsigned int q) {
+  while (q >= 24) {
+    put_bits(bw, 0, 24);
+    q -= 24;
+  }
+  put_bits(bw, 1, q + 1);
+}
+
+static void flush_bits(bitwriter_t *bw) {
+  if (bw->bits)
+    put_bits(bw, 0, 8 - bw->bits);
+}
+
+/* more bits consumed than the block holds (reads beyond it return 0) */
+static bool read_past_end(bitreader_t *br) {
+  return (br->pos * 8 - br->bits) > (br->size * 8);
+}
+
+static uint32_t get_bits(bitreader_t *br, unsigned int bits) {
+  if (!bits)
+    return 0;
+  while (br->bits < bits) {
+    br->acc = (br->acc << 8) | ((br->pos < br->size) ? br->buf[br->pos] : 0);
+    br->pos++;
+    br->bits += 8;
+  }
+  br->bits -= bits;
+  return (br->acc >> br->bits) & ((bits == 32) ? 0xffffffff :
+                                  ((1U << bits) - 1));
+}
+
+/* count zero bits up to the next one bit (which is consumed) */
+static unsigned int get_unary(bitreader_t *br) {
+  unsigned int q = 0, lz;
+  uint64_t window;
+
+  for (;;) {
+    while (br->bits <= 48) {
+      br->acc = (br->acc << 8) | ((br->pos < br->size) ? br->buf[br->pos] : 0);
+      br->pos++;
+      br->bits += 8;
+    }
+    window = br->acc & ((1ULL << br->bits) - 1);
+    if (window) {
+      lz = __builtin_clzll(window) - (64 - br->bits);
+      br->bits -= lz + 1;
+      return q + lz;
+    }
+    q += br->bits;
+    br->bits = 0;
+    if ((q > MAX_UNARY) || read_past_end(br))
+      return q;
+  }
+}
+
+static uint64_t get_bits64(bitreader_t *br, unsigned int bits) {
+  uint64_t hi = 0;
+
+  if (bits > 32) {
+    hi = (uint64_t)get_bits(br, bits - 32) << 32;
+    bits = 32;
+  }
+  return hi | get_bits(br, bits);
+}
+
+static inline uint64_t zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t u) {
+  return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+static inline int64_t sign_extend(uint64_t v, unsigned int bits) {
+  return (int64_t)((uint64_t)v << (64 - bits)) >> (64 - bits);
+}
+
+static unsigned int sample_bits(snd_pcm_format_t format) {
+  if (format == SND_PCM_FORMAT_S16_LE)
+    return 16;
+  if (format == SND_PCM_FORMAT_S24_LE)
+    return 24;
+  return 32;
+}
+
+/* residual of fixed predictor 'order' at sample i (i >= order) */
+static inline int64_t residual(const int64_t *x, unsigned int i,
+                               unsigned int order) {
+  switch (order) {
+    case 0: return x[i];
+    case 1: return x[i] - x[i-1];
+    case 2: return x[i] - 2 * x[i-1] + x[i-2];
+    default: return x[i] - 3 * x[i-1] + 3 * x[i-2] - x[i-3];
+  }
+}
+
+static inline int64_t predict(const int64_t *x, unsigned int i,
+                              unsigned int order) {
+  switch (order) {
+    case 0: return 0;
+    case 1: return x[i-1];
+    case 2: return 2 * x[i-1] - x[i-2];
+    default: return 3 * x[i-1] - 3 * x[i-2] + x[i-3];
+  }
+}
+
+/* pick the predictor order with the smallest total residual magnitude */
+static unsigned int best_order(const int64_t *x, unsigned int n,
+                               uint64_t *cost) {
+  uint64_t sum[MAX_ORDER + 1] = { 0 };
+  unsigned int i, order, best = 0;
+  int64_t e0, e1, e2, e3;
+
+  for (i = MAX_ORDER; i < n; i++) {
+    e0 = x[i];
+    e1 = e0 - x[i-1];
+    e2 = e1 - (x[i-1] - x[i-2]);
+    e3 = e2 - ((x[i-1] - x[i-2]) - (x[i-2] - x[i-3]));
+    sum[0] += llabs(e0);
+    sum[1] += llabs(e1);
+    sum[2] += llabs(e2);
+    sum[3] += llabs(e3);
+  }
+
+  for (order = 1; order <= MAX_ORDER; order++) {
+    if (sum[order] < sum[best])
+      best = order;
+  }
+  if (cost)
+    *cost = sum[best];
+  return (n > MAX_ORDER) ? best : 0;
+}
+
+/* Rice code zigzagged residuals u[0..n-1].  The raw escape is followed by
+ * a width field of width_bits (6 in our blocks, 5 in FLAC) */
+static void encode_partition(bitwriter_t *bw, const uint64_t *u,
+                             unsigned int n, unsigned int raw_bits,
+                             unsigned int width_bits) {
+  uint64_t sum = 0, max = 0;
+  unsigned int i, k = 0;
+
+  for (i = 0; i < n; i++) {
+    sum += u[i];
+    max = (u[i] > max) ? u[i] : max;
+  }
+
+  /* Rice parameter close to log2 of the mean */
+  while ((k < RICE_ESCAPE - 1) && (((uint64_t)n << (k + 1)) < sum))
+    k++;
+
+  /* escape to raw values if the largest code would be too long */
+  if ((max >> k) > MAX_UNARY) {
+    put_bits(bw, RICE_ESCAPE, RICE_BITS);
+    put_bits(bw, raw_bits, width_bits);
+    for (i = 0; i < n; i++)
+      put_bits64(bw, unzigzag(u[i]), raw_bits);
+    return;
+  }
+
+  put_bits(bw, k, RICE_BITS);
+  for (i = 0; i < n; i++) {
+    put_unary(bw, u[i] >> k);            /* quotient */
+    put_bits(bw, (uint32_t)u[i], k);     /* remainder */
+  }
+}
+
+static void encode_channel(bitwriter_t *bw, const int64_t *x, unsigned int n,
+                           unsigned int bits) {
+  unsigned int order, i, start;
+  uint64_t u[n];
+
+  order = best_order(x, n, NULL);
+  put_bits(bw, order, 2);
+  for (i = 0; i < order; i++)
+    put_bits64(bw, x[i], bits);
+
+  for (i = order; i < n; i++)
+    u[i] = zigzag(residual(x, i, order));
+
+  for (start = order; start < n; start += CODEC_PARTITION) {
+    encode_partition(bw, &u[start],
+                     (start + CODEC_PARTITION < n) ? CODEC_PARTITION : n - start,
+                     bits + MAX_ORDER, 6);
+  }
+}
+
+static int decode_channel(bitreader_t *br, int64_t *x, unsigned int n,
+                          unsigned int bits) {
+  unsigned int order, i, start, end, k, raw_bits;
+  uint64_t q;
+
+  order = get_bits(br, 2);
+  if (order > n)
+    return -EINVAL;
+  for (i = 0; i < order; i++)
+    x[i] = sign_extend(get_bits64(br, bits), bits);
+
+  for (start = order; start < n; start += CODEC_PARTITION) {
+    end = (start + CODEC_PARTITION < n) ? start + CODEC_PARTITION : n;
+    k = get_bits(br, RICE_BITS);
+    if (k == RICE_ESCAPE) {
+      raw_bits = get_bits(br, 6);
+      if (!raw_bits)
+        return -EINVAL;
+      for (i = start; i < end; i++)
+        x[i] = predict(x, i, order) +
+               sign_extend(get_bits64(br, raw_bits), raw_bits);
+      continue;
+    }
+    for (i = start; i < end; i++) {
+      q = get_unary(br);
+      if ((q > MAX_UNARY) || read_past_end(br))
+        return -EINVAL;
+      x[i] = predict(x, i, order) + unzigzag((q << k) | get_bits(br, k));
+    }
+  }
+
+  return read_past_end(br) ? -EINVAL : 0;
+}
+
+/* Upper bound of an encoded block (escaped residuals plus headers) */
+size_t codec_max_bytes(snd_pcm_format_t format, unsigned int channels,
+                       unsigned int frames) {
+  size_t partitions = (frames + CODEC_PARTITION - 1) / CODEC_PARTITION;
+  size_t bits = 1 + channels * (2 + MAX_ORDER * (sample_bits(format) + 1) +
+                                partitions * (RICE_BITS + 6) +
+                                frames * (sample_bits(format) + 1 + MAX_ORDER));
+  return (bits + 7) / 8;
+}
+
+/* Load a block of interleaved samples into per channel arrays and convert
+ * stereo to left/side when the channels are correlated.  Returns true if
+ * x[1] holds the side channel */
+static bool load_block(snd_pcm_format_t format, unsigned int channels,
+                       const uint8_t *pcm, unsigned int frames,
+                       int64_t (*x)[frames]) {
+  uint64_t cost_right, cost_side;
+  unsigned int i, chan;
+
+  for (i = 0; i < frames; i++) {
+    for (chan = 0; chan < channels; chan++)
+      x[chan][i] = pcm_get_sample(format, pcm, i * channels + chan);
+  }
+
+  if (channels == 2) {
+    int64_t s[frames];
+    for (i = 0; i < frames; i++)
+      s[i] = x[0][i] - x[1][i];
+    best_order(x[1], frames, &cost_right);
+    best_order(s, frames, &cost_side);
+    if (cost_side < cost_right) {
+      memcpy(x[1], s, sizeof(s));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Encode a block.  Returns encoded length or negative error */
+int codec_encode(snd_pcm_format_t format, unsigned int channels,
+                 const uint8_t *pcm, unsigned int frames,
+                 uint8_t *out, size_t out_max) {
+  int64_t x[channels][frames];
+  bitwriter_t bw = { .buf = out, .size = out_max };
+  unsigned int bits = sample_bits(format);
+  unsigned int chan;
+  bool side;
+
+  if (!channels || channels > MAX_CHANNELS)
+    return -EINVAL;
+
+  side = load_block(format, channels, pcm, frames, x);
+
+  put_bits(&bw, side, 1);
+  for (chan = 0; chan < channels; chan++)
+    encode_channel(&bw, x[chan], frames, bits + ((side && chan == 1) ? 1 : 0));
+  flush_bits(&bw);
+
+  return bw.overflow ? -ENOSPC : (int)bw.pos;
+}
+
+/* Decode a block.  Returns 0 on success */
+int codec_decode(snd_pcm_format_t format, unsigned int channels,
+                 const uint8_t *in, size_t len,
+                 uint8_t *pcm, unsigned int frames) {
+  int64_t x[channels][frames];
+  bitreader_t br = { .buf = in, .size = len };
+  unsigned int bits = sample_bits(format);
+  unsigned int i, chan;
+  bool side;
+  int err;
+
+  if (!channels || channels > MAX_CHANNELS)
+    return -EINVAL;
+
+  side = get_bits(&br, 1);
+  for (chan = 0; chan < channels; chan++) {
+    err = decode_channel(&br, x[chan], frames,
+                         bits + ((side && chan == 1) ? 1 : 0));
+    if (err)
+      return err;
+  }
+
+  if (side && channels == 2) {
+    for (i = 0; i < frames; i++)
+      x[1][i] = x[0][i] - x[1][i];
+  }
+
+  for (i = 0; i < frames; i++) {
+    for (chan = 0; chan < channels; chan++)
+      pcm_put_sample(format, pcm, i * channels + chan, (int32_t)x[chan][i]);
+  }
+
+  return 0;
+}
+
+/*
+ * FLAC files
+ *
+ * The same predictors and Rice coding produce standard FLAC frames (fixed
+ * subframes, RICE2 residuals) for recordings.  Every frame holds one
+ * period so the stream uses a fixed block size.
+ */
+static uint8_t flac_crc8(const uint8_t *buf, size_t len) {
+  uint8_t crc = 0;
+  unsigned int bit;
+
+  while (len--) {
+    crc ^= *buf++;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  }
+  return crc;
+}
+
+static uint16_t flac_crc16(const uint8_t *buf, size_t len) {
+  uint16_t crc = 0;
+  unsigned int bit;
+
+  while (len--) {
+    crc ^= (uint16_t)*buf++ << 8;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : (crc << 1);
+  }
+  return crc;
+}
+
+/* frame number in FLAC's extended UTF-8 coding */
+static void put_utf8(bitwriter_t *bw, uint32_t v) {
+  unsigned int len, i;
+
+  if (v < 0x80) {
+    put_bits(bw, v, 8);
+    return;
+  }
+  for (len = 2; (len < 6) && (v >= (1U << (5 * len + 1))); len++);
+  put_bits(bw, (1U << (len + 1)) - 2, len + 1);
+  put_bits(bw, v >> (6 * (len - 1)), 7 - len);
+  for (i = len - 1; i > 0; i--)
+    put_bits(bw, 0x80 | ((v >> (6 * (i - 1))) & 0x3f), 8);
+}
+
+static void flac_subframe(bitwriter_t *bw, const int64_t *x, unsigned int n,
+                          unsigned int bits) {
+  unsigned int order, i, p = 0, part, start, end;
+  uint64_t u[n];
+
+  order = best_order(x, n, NULL);
+  put_bits(bw, 0x10 | (order << 1), 8);  /* pad, FIXED type, no wasted bits */
+  for (i = 0; i < order; i++)
+    put_bits64(bw, x[i], bits);
+
+  for (i = order; i < n; i++)
+    u[i] = zigzag(residual(x, i, order));
+
+  /* the block divides evenly into 2^p partitions of about CODEC_PARTITION */
+  while ((p < 15) && !(n & ((2U << p) - 1)) &&
+         ((n >> (p + 1)) >= CODEC_PARTITION))
+    p++;
+
+  put_bits(bw, 1, 2);               /* RICE2: 5 bit Rice parameters */
+  put_bits(bw, p, 4);
+  for (part = 0, start = order; part < (1U << p); part++, start = end) {
+    end = (part + 1) * (n >> p);
+    encode_partition(bw, &u[start], end - start, bits + MAX_ORDER, 5);
+  }
+}
+
+/* Stream marker and STREAMINFO.  total_frames of 0 means unknown */
+int codec_flac_header(snd_pcm_format_t format, unsigned int channels,
+                      unsigned int rate, unsigned int block_frames,
+                      uint64_t total_frames, uint8_t *out) {
+  bitwriter_t bw = { .buf = out, .size = CODEC_FLAC_HEADER_BYTES };
+  unsigned int i;
+
+  if ((format == SND_PCM_FORMAT_S32_LE) || !channels || (channels > 8) ||
+      (block_frames < 16) || (block_frames > 65535)) {
+    return -EINVAL;
+  }
+
+  put_bits(&bw, 0x664c6143, 32);      /* "fLaC" */
+  put_bits(&bw, 0x80, 8);             /* last metadata block, STREAMINFO */
+  put_bits(&bw, 34, 24);
+  put_bits(&bw, block_frames, 16);    /* min/max block size */
+  put_bits(&bw, block_frames, 16);
+  put_bits(&bw, 0, 24);               /* min/max frame size unknown */
+  put_bits(&bw, 0, 24);
+  put_bits(&bw, rate, 20);
+  put_bits(&bw, channels - 1, 3);
+  put_bits(&bw, sample_bits(format) - 1, 5);
+  put_bits64(&bw, total_frames, 36);
+  for (i = 0; i < 4; i++)
+    put_bits(&bw, 0, 32);             /* no MD5 */
+
+  return bw.overflow ? -ENOSPC : (int)bw.pos;
+}
+
+/* Upper bound of an encoded FLAC frame */
+size_t codec_flac_max_bytes(snd_pcm_format_t format, unsigned int channels,
+                            unsigned int frames) {
+  return codec_max_bytes(format, channels, frames) + channels * 4 + 16;
+}
+
+/* Encode one FLAC frame.  Returns encoded length or negative error */
+int codec_flac_frame(snd_pcm_format_t format, unsigned int channels,
+                     const uint8_t *pcm, unsigned int frames,
+                     uint32_t frame_num, uint8_t *out, size_t out_max) {
+  int64_t x[channels][frames];
+  bitwriter_t bw = { .buf = out, .size = out_max };
+  unsigned int bits = sample_bits(format);
+  unsigned int chan;
+  bool side;
+
+  if (!channels || channels > MAX_CHANNELS)
+    return -EINVAL;
+
+  side = load_block(format, channels, pcm, frames, x);
+
+  put_bits(&bw, 0xfff8, 16);            /* sync, fixed block size */
+  put_bits(&bw, 0x7, 4);                /* 16 bit block size at end */
+  put_bits(&bw, 0x0, 4);                /* rate from STREAMINFO */
+  put_bits(&bw, side ? 0x8 : channels - 1, 4);
+  put_bits(&bw, 0x0, 4);                /* sample size from STREAMINFO */
+  put_utf8(&bw, frame_num);
+  put_bits(&bw, frames - 1, 16);
+  if (!bw.overflow)
+    put_bits(&bw, flac_crc8(out, bw.pos), 8);
+
+  for (chan = 0; chan < channels; chan++)
+    flac_subframe(&bw, x[chan], frames, bits + ((side && chan == 1) ? 1 : 0));
+  flush_bits(&bw);
+  if (!bw.overflow)
+    put_bits(&bw, flac_crc16(out, bw.pos), 16);
+
+  return bw.overflow ? -ENOSPC : (int)bw.pos;
+}
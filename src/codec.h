@@ -0,0 +1,36 @@
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Lossless audio block codec in the style of FLAC: each channel of a block
+ * is coded with the best fixed polynomial predictor (order 0-3) and the
+ * residual is Rice coded in partitions.  Stereo blocks may be coded as
+ * left/side.
+ */
+
+#define CODEC_PARTITION  256  /* residual samples per Rice partition */
+
+size_t codec_max_bytes(snd_pcm_format_t format, unsigned int channels,
+                       unsigned int frames);
+int codec_encode(snd_pcm_format_t format, unsigned int channels,
+                 const uint8_t *pcm, unsigned int frames,
+                 uint8_t *out, size_t out_max);
+int codec_decode(snd_pcm_format_t format, unsigned int channels,
+                 const uint8_t *in, size_t len,
+                 uint8_t *pcm, unsigned int frames);
+
+/* FLAC files (16 and 24 bit) */
+#define CODEC_FLAC_HEADER_BYTES  42
+
+int codec_flac_header(snd_pcm_format_t format, unsigned int channels,
+                      unsigned int rate, unsigned int block_frames,
+                      uint64_t total_frames, uint8_t *out);
+size_t codec_flac_max_bytes(snd_pcm_format_t format, unsigned int channels,
+                            unsigned int frames);
+int codec_flac_frame(snd_pcm_format_t format, unsigned int channels,
+                     const uint8_t *pcm, unsigned int frames,
+                     uint32_t frame_num, uint8_t *out, size_t out_max);
+#endif
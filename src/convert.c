@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "convert.h"
+#include "dsp.h"
+#include "pcm.h"
+
+/*
+ * Capture to playback conversion
+ *
+ * The delay buffer always holds audio in the capture format.  When the
+ * playback interface runs at a different rate, sample format or channel
+ * count, every write is converted in a single pass: each output sample is
+ * linearly interpolated between the two nearest input frames (the position
+ * is carried across writes, so there are no seams between periods), taken
+ * from the capture channel the channel map names (or a mix of all of
+ * them), and stored in the playback format.  Samples are handled as 32 bit
+ * integers throughout so no precision is lost when only the format or
+ * channels differ.
+ *
+ * With identical settings on both sides nothing is converted.
+ */
+
+typedef struct convert {
+  uint64_t step;      /* input frames per output frame (32.32 fixed point) */
+  int64_t pos;        /* position of next output frame (32.32) relative to
+                         the first frame of the next write; the frame before
+                         it (-1) is 'last' */
+  int32_t last[CONVERT_MAX_CHANNELS];  /* final input frame of last write */
+  int map[CONVERT_MAX_CHANNELS];       /* capture channel of each output */
+  uint8_t *out;
+  unsigned int max_in;
+  unsigned int max_out;
+} convert_t;
+
+/* sample scaled to the full 32 bit range */
+static inline int32_t get32(snd_pcm_format_t format, const uint8_t *data,
+                            unsigned int idx) {
+  if (format == SND_PCM_FORMAT_S16_LE)
+    return (int32_t)((uint32_t)((const int16_t *)data)[idx] << 16);
+  if (format == SND_PCM_FORMAT_S24_LE)
+    return (int32_t)((uint32_t)((const int32_t *)data)[idx] << 8);
+  return ((const int32_t *)data)[idx];
+}
+
+/* round a full range sample to the format's width */
+static inline int32_t narrow(snd_pcm_format_t format, int64_t v) {
+  unsigned int shift = (format == SND_PCM_FORMAT_S16_LE) ? 16 :
+                       (format == SND_PCM_FORMAT_S24_LE) ? 8 : 0;
+
+  if (shift) {
+    v = (v + (1LL << (shift - 1))) >> shift;
+  }
+  if (v > (INT32_MAX >> shift)) {
+    v = INT32_MAX >> shift;
+  }
+  return v;
+}
+
+/* capture channel 'ch' (or the mix) of a frame */
+static inline int32_t map_sample(buffer_config_t *bc, const uint8_t *data,
+                                 unsigned int frame, int ch) {
+  unsigned int c;
+  int64_t sum = 0;
+
+  if (ch != CONVERT_MIX) {
+    return get32(bc->format, data, frame * bc->channels + ch);
+  }
+  for (c = 0; c < bc->channels; c++) {
+    sum += get32(bc->format, data, frame * bc->channels + c);
+  }
+  return sum / (int)bc->channels;
+}
+
+/* "0,1,m,..." -> capture channel per playback channel.  Returns count */
+static int parse_map(const char *spec, unsigned int channels, int *map) {
+  char *end;
+  long ch;
+  int n = 0;
+
+  while (*spec) {
+    if (n == CONVERT_MAX_CHANNELS) {
+      return -EINVAL;
+    }
+    if (*spec == 'm') {
+      map[n++] = CONVERT_MIX;
+      end = (char *)spec + 1;
+    } else {
+      ch = strtol(spec, &end, 10);
+      if ((end == spec) || (ch < 0) || (ch >= channels)) {
+        return -EINVAL;
+      }
+      map[n++] = ch;
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end) {
+      return -EINVAL;
+    }
+    spec = end;
+  }
+
+  return n ? n : -EINVAL;
+}
+
+/*
+ * External Interface Functions
+ */
+
+/* Work out the playback settings.  Called before the playback interface
+ * is configured; bc->play_* are filled in with what's requested */
+int convert_init(buffer_config_t *bc, settings_t *settings) {
+  convert_t *cv;
+  int n;
+
+  cv = calloc(1, sizeof(*cv));
+  if (!cv) {
+    return -ENOMEM;
+  }
+
+  for (n = 0; n < CONVERT_MAX_CHANNELS; n++) {
+    cv->map[n] = n % bc->channels;
+  }
+  bc->play_channels = bc->channels;
+  if (settings->play_map[0]) {
+    if ((n = parse_map(settings->play_map, bc->channels, cv->map)) < 0) {
+      fprintf(stderr, "Invalid playback channel map '%s'\n",
+              settings->play_map);
+      free(cv);
+      return -EINVAL;
+    }
+    bc->play_channels = n;
+  }
+  bc->convert = cv;
+
+  return 0;
+}
+
+/* Called once the playback interface is configured */
+int convert_start(buffer_config_t *bc, settings_t *settings) {
+  convert_t *cv = bc->convert;
+  unsigned int n;
+  bool identity = true;
+
+  bc->play_frame_bytes = (snd_pcm_format_physical_width(bc->play_format) / 8) *
+                         bc->play_channels;
+
+  for (n = 0; n < bc->play_channels; n++) {
+    identity = identity && (cv->map[n] == n);
+  }
+  if (identity && (bc->play_channels == bc->channels) &&
+      (bc->play_format == bc->format) && (bc->play_rate == bc->rate)) {
+    /* nothing to do */
+    bc->convert = NULL;
+    free(cv);
+    return 0;
+  }
+
+  cv->step = ((uint64_t)bc->rate << 32) / bc->play_rate;
+  cv->pos = 0;
+  cv->max_in = bc->period_frames * DSP_MAX_STRETCH + 1;
+  cv->max_out = ((uint64_t)cv->max_in * bc->play_rate) / bc->rate + 2;
+  cv->out = malloc(cv->max_out * bc->play_frame_bytes);
+  if (!cv->out) {
+    fprintf(stderr, "Could not allocate conversion memory\n");
+    convert_cleanup(bc);
+    return -ENOMEM;
+  }
+
+  if (settings->verbose) {
+    printf("Converting %s %dch %dHz to %s %dch %dHz for playback\n",
+           snd_pcm_format_name(bc->format), bc->channels, bc->rate,
+           snd_pcm_format_name(bc->play_format), bc->play_channels,
+           bc->play_rate);
+  }
+
+  return 0;
+}
+
+void convert_cleanup(buffer_config_t *bc) {
+  convert_t *cv = bc->convert;
+
+  if (!cv) {
+    return;
+  }
+
+  free(cv->out);
+  free(cv);
+  bc->convert = NULL;
+}
+
+/*
+ * Convert 'frames' capture frames for playback.  Returns the converted
+ * audio (valid until the next call) and its length in out_frames, or
+ * 'data' itself if no conversion is needed.  Audio thread only.
+ */
+uint8_t *convert_process(buffer_config_t *bc, uint8_t *data,
+                         unsigned int frames, unsigned int *out_frames) {
+  convert_t *cv = bc->convert;
+  unsigned int o, c, idx;
+  int64_t pos, i, frac;
+  int32_t a, b;
+
+  *out_frames = frames;
+  if (!cv || !frames) {
+    return data;
+  }
+
+  if (frames > cv->max_in) {
+    fprintf(stderr, "Warning: %u frames not converted\n", frames);
+    *out_frames = 0;
+    return data;
+  }
+
+  /* output frames lie between input frames i and i+1, where frame -1 is
+   * the last one of the previous write */
+  pos = cv->pos;
+  for (o = 0; ((pos >> 32) < (int64_t)frames - 1) && (o < cv->max_out); o++) {
+    i = pos >> 32;
+    frac = (uint32_t)pos >> 16;   /* 16 bits is plenty and can't overflow */
+    for (c = 0; c < bc->play_channels; c++) {
+      a = (i < 0) ? cv->last[c] : map_sample(bc, data, i, cv->map[c]);
+      b = map_sample(bc, data, i + 1, cv->map[c]);
+      idx = o * bc->play_channels + c;
+      pcm_put_sample(bc->play_format, cv->out, idx, narrow(bc->play_format,
+                     a + ((((int64_t)b - a) * frac) >> 16)));
+    }
+    pos += cv->step;
+  }
+
+  for (c = 0; c < bc->play_channels; c++) {
+    cv->last[c] = map_sample(bc, data, frames - 1, cv->map[c]);
+  }
+  cv->pos = pos - ((int64_t)frames << 32);
+
+  *out_frames = o;
+  return cv->out;
+}
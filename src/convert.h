@@ -0,0 +1,15 @@
+#ifndef __CONVERT_H
+#define __CONVERT_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+#define CONVERT_MAX_CHANNELS 8
+#define CONVERT_MIX          -1  /* channel map entry: mix of all channels */
+
+int convert_init(buffer_config_t *bc, settings_t *settings);
+int convert_start(buffer_config_t *bc, settings_t *settings);
+void convert_cleanup(buffer_config_t *bc);
+uint8_t *convert_process(buffer_config_t *bc, uint8_t *data,
+                         unsigned int frames, unsigned int *out_frames);
+#endif
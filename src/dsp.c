@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "dsp.h"
+
+/*
+ * Playback processing chain
+ *
+ * Everything written to the playback interface (after any stretching,
+ * splicing or silence insertion) runs through a chain of processing
+ * blocks: biquad EQ filters, gain, a peak limiter and loudness
+ * normalization.  Samples are converted to float once, processed in place
+ * by each block and converted back into a scratch buffer which is then
+ * written.  With an empty chain the audio is written untouched.
+ *
+ * The chain is changed at runtime from the UI thread: it edits its own copy
+ * of the block settings, builds a new chain and hands it over.  The audio
+ * thread swaps it in between writes, carrying over filter, gain and level
+ * state from the block it replaces so changes don't click.  Gain changes
+ * are ramped.
+ *
+ * The kernels are simple loops over interleaved frames which the compiler
+ * vectorizes (gain, level sums, conversions) or at least pairs up across
+ * the channels (biquads, whose recursion can't be vectorized in time).
+ * The time spent in each block is measured and reported per period.
+ */
+
+typedef enum dsp_type {
+  DSP_PEAK,
+  DSP_LOWSHELF,
+  DSP_HIGHSHELF,
+  DSP_LOWPASS,
+  DSP_HIGHPASS,
+  DSP_GAIN,
+  DSP_LIMIT,
+  DSP_LOUD,
+  DSP_NUM_TYPES
+} dsp_type_t;
+
+static const char *dsp_type_name[DSP_NUM_TYPES] = {
+  "peak", "lowshelf", "highshelf", "lowpass", "highpass", "gain", "limit",
+  "loud"
+};
+
+typedef struct dsp_config {
+  dsp_type_t type;
+  float freq;
+  float db;      /* gain, threshold or target level */
+  float q;
+} dsp_config_t;
+
+typedef struct dsp_block {
+  dsp_config_t cfg;
+
+  /* biquad (transposed direct form II) */
+  float b0, b1, b2, a1, a2;
+  float z1[DSP_MAX_CHANNELS];
+  float z2[DSP_MAX_CHANNELS];
+
+  float gain;       /* gain/loud: current linear gain */
+  float target;     /* gain: linear gain ramped to; limit: threshold */
+  float env;        /* limit: peak envelope */
+  float ms;         /* loud: mean square level */
+
+  /* cost */
+  uint64_t ns;
+  uint64_t frames;
+} dsp_block_t;
+
+typedef struct dsp_chain {
+  unsigned int num;
+  dsp_block_t block[DSP_MAX_BLOCKS];
+} dsp_chain_t;
+
+typedef struct dsp {
+  float *buf;                 /* float samples being processed */
+  uint8_t *out;               /* processed samples in playback format */
+  unsigned int max_frames;
+  unsigned int stats_n;
+
+  dsp_chain_t *active;        /* audio thread only */
+  dsp_chain_t *pending;       /* new chain handed to the audio thread */
+  dsp_chain_t *retired;       /* replaced chain handed back to be freed */
+
+  /* UI thread only */
+  unsigned int num_cfg;
+  dsp_config_t cfg[DSP_MAX_BLOCKS];
+} dsp_t;
+
+static float db_to_lin(float db) {
+  return powf(10.0f, db / 20.0f);
+}
+
+/* "type,a,b,c" -> config.  Returns 0 on success */
+static int parse_spec(const char *spec, dsp_config_t *cfg) {
+  char name[16];
+  float p[3] = { 0, 0, 0 };
+  int n, type;
+
+  n = sscanf(spec, "%15[a-z],%f,%f,%f", name, &p[0], &p[1], &p[2]);
+  if (n < 1) {
+    return -EINVAL;
+  }
+
+  for (type = 0; type < DSP_NUM_TYPES; type++) {
+    if (!strcmp(name, dsp_type_name[type])) {
+      break;
+    }
+  }
+
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->type = type;
+  cfg->q = 0.7071f;
+  switch (type) {
+    case DSP_PEAK:
+      if (n < 4) {
+        return -EINVAL;
+      }
+      cfg->q = p[2];
+      /* fall through */
+    case DSP_LOWSHELF:
+    case DSP_HIGHSHELF:
+      if (n < 3) {
+        return -EINVAL;
+      }
+      cfg->freq = p[0];
+      cfg->db = p[1];
+      break;
+    case DSP_LOWPASS:
+    case DSP_HIGHPASS:
+      if (n < 2) {
+        return -EINVAL;
+      }
+      cfg->freq = p[0];
+      cfg->q = (n > 2) ? p[1] : cfg->q;
+      break;
+    case DSP_GAIN:
+      if (n < 2) {
+        return -EINVAL;
+      }
+      cfg->db = p[0];
+      break;
+    case DSP_LIMIT:
+      cfg->db = (n > 1) ? p[0] : -1.0f;
+      break;
+    case DSP_LOUD:
+      cfg->db = (n > 1) ? p[0] : -20.0f;
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  if ((cfg->q <= 0) || (cfg->freq < 0) || (cfg->db > 40) || (cfg->db < -96)) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+/* RBJ audio EQ cookbook coefficients */
+static void biquad_coefs(dsp_block_t *b, unsigned int rate) {
+  double A = pow(10.0, b->cfg.db / 40.0);
+  double w0 = 2 * M_PI * fmin(b->cfg.freq, rate * 0.49) / rate;
+  double cw = cos(w0);
+  double alpha = sin(w0) / (2 * b->cfg.q);
+  double sa = 2 * sqrt(A) * alpha;
+  double b0, b1, b2, a0, a1, a2;
+
+  switch (b->cfg.type) {
+    case DSP_PEAK:
+      b0 = 1 + alpha * A;   b1 = -2 * cw;   b2 = 1 - alpha * A;
+      a0 = 1 + alpha / A;   a1 = -2 * cw;   a2 = 1 - alpha / A;
+      break;
+    case DSP_LOWSHELF:
+      b0 = A * ((A + 1) - (A - 1) * cw + sa);
+      b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+      b2 = A * ((A + 1) - (A - 1) * cw - sa);
+      a0 = (A + 1) + (A - 1) * cw + sa;
+      a1 = -2 * ((A - 1) + (A + 1) * cw);
+      a2 = (A + 1) + (A - 1) * cw - sa;
+      break;
+    case DSP_HIGHSHELF:
+      b0 = A * ((A + 1) + (A - 1) * cw + sa);
+      b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+      b2 = A * ((A + 1) + (A - 1) * cw - sa);
+      a0 = (A + 1) - (A - 1) * cw + sa;
+      a1 = 2 * ((A - 1) - (A + 1) * cw);
+      a2 = (A + 1) - (A - 1) * cw - sa;
+      break;
+    case DSP_LOWPASS:
+      b0 = (1 - cw) / 2;    b1 = 1 - cw;    b2 = (1 - cw) / 2;
+      a0 = 1 + alpha;       a1 = -2 * cw;   a2 = 1 - alpha;
+      break;
+    default:  /* DSP_HIGHPASS */
+      b0 = (1 + cw) / 2;    b1 = -(1 + cw); b2 = (1 + cw) / 2;
+      a0 = 1 + alpha;       a1 = -2 * cw;   a2 = 1 - alpha;
+      break;
+  }
+
+  b->b0 = b0 / a0;
+  b->b1 = b1 / a0;
+  b->b2 = b2 / a0;
+  b->a1 = a1 / a0;
+  b->a2 = a2 / a0;
+}
+
+/*
+ * Kernels
+ */
+static void run_biquad(dsp_block_t *b, float *restrict x, unsigned int frames,
+                       unsigned int channels) {
+  float z1[DSP_MAX_CHANNELS], z2[DSP_MAX_CHANNELS];
+  unsigned int i, c;
+
+  memcpy(z1, b->z1, sizeof(z1));
+  memcpy(z2, b->z2, sizeof(z2));
+  for (i = 0; i < frames; i++) {
+    for (c = 0; c < channels; c++) {
+      float in = x[i * channels + c];
+      float out = b->b0 * in + z1[c];
+      z1[c] = b->b1 * in - b->a1 * out + z2[c];
+      z2[c] = b->b2 * in - b->a2 * out;
+      x[i * channels + c] = out;
+    }
+  }
+
+  /* don't let the state decay into denormals during silence */
+  for (c = 0; c < channels; c++) {
+    b->z1[c] = (fabsf(z1[c]) < 1e-15f) ? 0 : z1[c];
+    b->z2[c] = (fabsf(z2[c]) < 1e-15f) ? 0 : z2[c];
+  }
+}
+
+/* gain ramped linearly from g0 to g1 across the block */
+static void run_ramp(float *restrict x, unsigned int frames,
+                     unsigned int channels, float g0, float g1) {
+  float step = (g1 - g0) / frames;
+  unsigned int i, c;
+
+  if (g0 == g1) {
+    for (i = 0; i < frames * channels; i++) {
+      x[i] *= g0;
+    }
+    return;
+  }
+
+  for (i = 0; i < frames; i++) {
+    float g = g0 + step * i;
+    for (c = 0; c < channels; c++) {
+      x[i * channels + c] *= g;
+    }
+  }
+}
+
+/* move 'gain' toward 'target' by no more than max_db */
+static float slew(float gain, float target, float max_db) {
+  float max = db_to_lin(max_db);
+
+  if (target > gain * max) {
+    return gain * max;
+  }
+  if (target < gain / max) {
+    return gain / max;
+  }
+  return target;
+}
+
+static void run_gain(dsp_block_t *b, float *x, unsigned int frames,
+                     unsigned int channels, unsigned int rate) {
+  float g0 = b->gain;
+
+  b->gain = slew(b->gain, b->target, DSP_RAMP_DB_S * frames / rate);
+  run_ramp(x, frames, channels, g0, b->gain);
+}
+
+/* linked peak limiter: instant attack, exponential release */
+static void run_limit(dsp_block_t *b, float *restrict x, unsigned int frames,
+                      unsigned int channels, unsigned int rate) {
+  float release = expf(-1000.0f / (DSP_LIMIT_REL_MS * rate));
+  float env = b->env;
+  unsigned int i, c;
+
+  for (i = 0; i < frames; i++) {
+    float peak = 0;
+    for (c = 0; c < channels; c++) {
+      float a = fabsf(x[i * channels + c]);
+      peak = (a > peak) ? a : peak;
+    }
+    env = (peak > env) ? peak : env * release;
+    if (env > b->target) {
+      float g = b->target / env;
+      for (c = 0; c < channels; c++) {
+        x[i * channels + c] *= g;
+      }
+    }
+  }
+  b->env = (env < 1e-15f) ? 0 : env;
+}
+
+/* slowly steer the average level toward the target */
+static void run_loud(dsp_block_t *b, float *restrict x, unsigned int frames,
+                     unsigned int channels, unsigned int rate) {
+  float sum = 0, ms, want, g0 = b->gain;
+  float alpha = frames / (DSP_LOUD_WINDOW_S * rate);
+  unsigned int i;
+
+  for (i = 0; i < frames * channels; i++) {
+    sum += x[i] * x[i];
+  }
+  ms = sum / (frames * channels);
+
+  /* only adapt to program material, not to gaps and fades */
+  if (ms > db_to_lin(DSP_LOUD_GATE_DB * 2)) {
+    b->ms += ((alpha < 1) ? alpha : 1) * (ms - b->ms);
+    want = db_to_lin(b->cfg.db) / sqrtf(b->ms);
+    want = (want < db_to_lin(DSP_LOUD_MAX_DB)) ? want : db_to_lin(DSP_LOUD_MAX_DB);
+    b->gain = slew(b->gain, want, DSP_LOUD_SLEW_DB_S * frames / rate);
+  }
+
+  run_ramp(x, frames, channels, g0, b->gain);
+}
+
+/*
+ * Format conversion
+ */
+static void to_float(snd_pcm_format_t format, const uint8_t *in,
+                     float *restrict out, unsigned int samples) {
+  unsigned int i;
+
+  if (format == SND_PCM_FORMAT_S16_LE) {
+    const int16_t *s = (const int16_t *)in;
+    for (i = 0; i < samples; i++) {
+      out[i] = s[i] * (1.0f / 32768.0f);
+    }
+  } else if (format == SND_PCM_FORMAT_S24_LE) {
+    const int32_t *s = (const int32_t *)in;
+    for (i = 0; i < samples; i++) {
+      out[i] = ((int32_t)((uint32_t)s[i] << 8)) * (1.0f / 2147483648.0f);
+    }
+  } else {
+    const int32_t *s = (const int32_t *)in;
+    for (i = 0; i < samples; i++) {
+      out[i] = s[i] * (1.0f / 2147483648.0f);
+    }
+  }
+}
+
+static void from_float(snd_pcm_format_t format, const float *restrict in,
+                       uint8_t *out, unsigned int samples) {
+  unsigned int i;
+
+  if (format == SND_PCM_FORMAT_S16_LE) {
+    int16_t *s = (int16_t *)out;
+    for (i = 0; i < samples; i++) {
+      float v = in[i] * 32768.0f;
+      v = (v > 32767.0f) ? 32767.0f : (v < -32768.0f) ? -32768.0f : v;
+      s[i] = (int16_t)(v + ((v >= 0) ? 0.5f : -0.5f));
+    }
+  } else {
+    /* S24 is scaled like S32 and shifted down into the container */
+    unsigned int shift = (format == SND_PCM_FORMAT_S24_LE) ? 8 : 0;
+    int32_t *s = (int32_t *)out;
+    for (i = 0; i < samples; i++) {
+      float v = in[i] * 2147483648.0f;
+      v = (v > 2147483520.0f) ? 2147483520.0f :
+          (v < -2147483648.0f) ? -2147483648.0f : v;
+      s[i] = ((int32_t)v) >> shift;
+    }
+  }
+}
+
+static uint64_t ns_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Chain management (UI thread)
+ */
+static dsp_chain_t *build_chain(buffer_config_t *bc, dsp_t *dsp) {
+  dsp_chain_t *chain;
+  dsp_block_t *b;
+  unsigned int i;
+
+  chain = calloc(1, sizeof(*chain));
+  if (!chain) {
+    return NULL;
+  }
+
+  chain->num = dsp->num_cfg;
+  for (i = 0; i < chain->num; i++) {
+    b = &chain->block[i];
+    b->cfg = dsp->cfg[i];
+    switch (b->cfg.type) {
+      case DSP_GAIN:
+        b->gain = b->target = db_to_lin(b->cfg.db);
+        break;
+      case DSP_LIMIT:
+        b->target = db_to_lin(b->cfg.db);
+        break;
+      case DSP_LOUD:
+        b->gain = 1.0f;
+        b->ms = db_to_lin(b->cfg.db * 2);
+        break;
+      default:
+        biquad_coefs(b, bc->rate);
+        break;
+    }
+  }
+
+  return chain;
+}
+
+/* hand a new chain to the audio thread and free any it has finished with */
+static int publish(buffer_config_t *bc, dsp_t *dsp) {
+  dsp_chain_t *chain, *old;
+
+  chain = build_chain(bc, dsp);
+  if (!chain) {
+    return -ENOMEM;
+  }
+
+  old = __atomic_exchange_n(&dsp->pending, chain, __ATOMIC_ACQ_REL);
+  free(old);
+  old = __atomic_exchange_n(&dsp->retired, NULL, __ATOMIC_ACQ_REL);
+  free(old);
+
+  if (bc->verbose) {
+    printf("DSP chain updated (%d blocks)\n", dsp->num_cfg);
+  }
+
+  return 0;
+}
+
+/* audio thread: start using a new chain, keeping the state of blocks
+ * which are still there */
+static void take_pending(dsp_t *dsp) {
+  dsp_chain_t *chain, *old = dsp->active;
+  dsp_block_t *b, *prev;
+  unsigned int i;
+
+  chain = __atomic_exchange_n(&dsp->pending, NULL, __ATOMIC_ACQ_REL);
+  if (!chain) {
+    return;
+  }
+
+  for (i = 0; old && (i < chain->num) && (i < old->num); i++) {
+    b = &chain->block[i];
+    prev = &old->block[i];
+    if (b->cfg.type != prev->cfg.type) {
+      continue;
+    }
+    memcpy(b->z1, prev->z1, sizeof(b->z1));
+    memcpy(b->z2, prev->z2, sizeof(b->z2));
+    b->env = prev->env;
+    b->ms = (b->cfg.type == DSP_LOUD) ? prev->ms : b->ms;
+    /* gain blocks ramp from where they were */
+    b->gain = (b->cfg.type == DSP_GAIN || b->cfg.type == DSP_LOUD) ?
+              prev->gain : b->gain;
+  }
+
+  __atomic_store_n(&dsp->active, chain, __ATOMIC_RELEASE);
+  old = __atomic_exchange_n(&dsp->retired, old, __ATOMIC_ACQ_REL);
+  free(old);
+}
+
+static void print_stats(buffer_config_t *bc, dsp_chain_t *chain) {
+  unsigned int i;
+  dsp_block_t *b;
+
+  printf("DSP:");
+  for (i = 0; i < chain->num; i++) {
+    b = &chain->block[i];
+    printf("  %s %.1f us", dsp_type_name[b->cfg.type],
+           b->frames ? (b->ns / 1000.0) * bc->period_frames / b->frames : 0.0);
+  }
+  printf("  (per period of %.1f us)\n", (double)bc->period_time);
+}
+
+/*
+ * External Interface Functions
+ */
+int dsp_init(buffer_config_t *bc, settings_t *settings) {
+  dsp_t *dsp;
+  unsigned int i;
+
+  if (bc->channels > DSP_MAX_CHANNELS) {
+    fprintf(stderr, "Processing supports up to %d channels\n",
+            DSP_MAX_CHANNELS);
+    return -EINVAL;
+  }
+
+  dsp = calloc(1, sizeof(*dsp));
+  if (!dsp) {
+    return -ENOMEM;
+  }
+
+  dsp->max_frames = bc->period_frames * DSP_MAX_STRETCH + 1;
+  dsp->buf = malloc(dsp->max_frames * bc->channels * sizeof(float));
+  dsp->out = malloc(dsp->max_frames * bc->frame_bytes);
+  if (!dsp->buf || !dsp->out) {
+    fprintf(stderr, "Could not allocate processing memory\n");
+    free(dsp->buf);
+    free(dsp->out);
+    free(dsp);
+    return -ENOMEM;
+  }
+  bc->dsp = dsp;
+
+  for (i = 0; i < settings->num_dsp; i++) {
+    if (parse_spec(settings->dsp[i], &dsp->cfg[i]) < 0) {
+      fprintf(stderr, "Invalid processing block '%s'\n", settings->dsp[i]);
+      dsp_cleanup(bc);
+      return -EINVAL;
+    }
+  }
+  dsp->num_cfg = settings->num_dsp;
+  if (dsp->num_cfg) {
+    publish(bc, dsp);
+  }
+
+  return 0;
+}
+
+void dsp_cleanup(buffer_config_t *bc) {
+  dsp_t *dsp = bc->dsp;
+
+  if (!dsp) {
+    return;
+  }
+
+  free(dsp->active);
+  free(dsp->pending);
+  free(dsp->retired);
+  free(dsp->buf);
+  free(dsp->out);
+  free(dsp);
+  bc->dsp = NULL;
+}
+
+/*
+ * Run the chain over audio about to be written.  Returns the processed
+ * audio (valid until the next call) or 'data' itself if there is nothing
+ * to do.  Audio thread only.
+ */
+uint8_t *dsp_process(buffer_config_t *bc, uint8_t *data, unsigned int frames) {
+  dsp_t *dsp = bc->dsp;
+  dsp_chain_t *chain;
+  dsp_block_t *b;
+  unsigned int i;
+  uint64_t start;
+
+  if (!dsp) {
+    return data;
+  }
+
+  take_pending(dsp);
+  chain = dsp->active;
+  if (!chain || !chain->num) {
+    return data;
+  }
+
+  /* longer than any stretched period; shouldn't happen */
+  if (frames > dsp->max_frames) {
+    fprintf(stderr, "Warning: %u frames not processed\n", frames);
+    return data;
+  }
+
+  to_float(bc->format, data, dsp->buf, frames * bc->channels);
+  for (i = 0; i < chain->num; i++) {
+    b = &chain->block[i];
+    start = ns_now();
+    switch (b->cfg.type) {
+      case DSP_GAIN:
+        run_gain(b, dsp->buf, frames, bc->channels, bc->rate);
+        break;
+      case DSP_LIMIT:
+        run_limit(b, dsp->buf, frames, bc->channels, bc->rate);
+        break;
+      case DSP_LOUD:
+        run_loud(b, dsp->buf, frames, bc->channels, bc->rate);
+        break;
+      default:
+        run_biquad(b, dsp->buf, frames, bc->channels);
+        break;
+    }
+    b->ns += ns_now() - start;
+    b->frames += frames;
+  }
+  from_float(bc->format, dsp->buf, dsp->out, frames * bc->channels);
+
+  if (bc->verbose && (++dsp->stats_n == DSP_STATS)) {
+    print_stats(bc, chain);
+    for (i = 0; i < chain->num; i++) {
+      chain->block[i].ns = chain->block[i].frames = 0;
+    }
+    dsp->stats_n = 0;
+  }
+
+  return dsp->out;
+}
+
+/* UI changes are parsed aside so a bad spec leaves the chain untouched */
+int dsp_add(buffer_config_t *bc, const char *spec) {
+  dsp_t *dsp = bc->dsp;
+  dsp_config_t cfg;
+
+  if (!dsp || (dsp->num_cfg >= DSP_MAX_BLOCKS) ||
+      (parse_spec(spec, &cfg) < 0)) {
+    return -EINVAL;
+  }
+  dsp->cfg[dsp->num_cfg++] = cfg;
+
+  return publish(bc, dsp);
+}
+
+int dsp_set(buffer_config_t *bc, unsigned int idx, const char *spec) {
+  dsp_t *dsp = bc->dsp;
+  dsp_config_t cfg;
+
+  if (!dsp || (idx >= dsp->num_cfg) || (parse_spec(spec, &cfg) < 0)) {
+    return -EINVAL;
+  }
+  dsp->cfg[idx] = cfg;
+
+  return publish(bc, dsp);
+}
+
+int dsp_remove(buffer_config_t *bc, unsigned int idx) {
+  dsp_t *dsp = bc->dsp;
+
+  if (!dsp || (idx >= dsp->num_cfg)) {
+    return -EINVAL;
+  }
+  memmove(&dsp->cfg[idx], &dsp->cfg[idx + 1],
+          (dsp->num_cfg - idx - 1) * sizeof(dsp->cfg[0]));
+  dsp->num_cfg--;
+
+  return publish(bc, dsp);
+}
+
+int dsp_clear(buffer_config_t *bc) {
+  dsp_t *dsp = bc->dsp;
+
+  if (!dsp) {
+    return -EINVAL;
+  }
+  dsp->num_cfg = 0;
+
+  return publish(bc, dsp);
+}
+
+unsigned int dsp_num_blocks(buffer_config_t *bc) {
+  return bc->dsp ? ((dsp_t *)bc->dsp)->num_cfg : 0;
+}
+
+/* average cost of block idx in uS per period since it was set up (or the
+ * last verbose report).  UI thread only, as it frees replaced chains */
+static double block_cost_us(buffer_config_t *bc, dsp_t *dsp, unsigned int idx) {
+  dsp_chain_t *chain = __atomic_load_n(&dsp->active, __ATOMIC_ACQUIRE);
+  dsp_block_t *b;
+  uint64_t ns, frames;
+
+  if (!chain || (idx >= chain->num)) {
+    return 0;
+  }
+
+  b = &chain->block[idx];
+  ns = b->ns;
+  frames = b->frames;
+  return frames ? (ns / 1000.0) * bc->period_frames / frames : 0;
+}
+
+/* "type,params,cost" of block idx.  UI thread only */
+int dsp_describe(buffer_config_t *bc, unsigned int idx, char *buf, size_t len) {
+  dsp_t *dsp = bc->dsp;
+  dsp_config_t *cfg;
+  const char *name;
+  double us;
+
+  if (!dsp || (idx >= dsp->num_cfg)) {
+    return -EINVAL;
+  }
+
+  cfg = &dsp->cfg[idx];
+  name = dsp_type_name[cfg->type];
+  us = block_cost_us(bc, dsp, idx);
+  switch (cfg->type) {
+    case DSP_PEAK:
+      return snprintf(buf, len, "%s,%g,%g,%g,%.1f", name, cfg->freq, cfg->db,
+                      cfg->q, us);
+    case DSP_LOWSHELF:
+    case DSP_HIGHSHELF:
+      return snprintf(buf, len, "%s,%g,%g,%.1f", name, cfg->freq, cfg->db, us);
+    case DSP_LOWPASS:
+    case DSP_HIGHPASS:
+      return snprintf(buf, len, "%s,%g,%g,%.1f", name, cfg->freq, cfg->q, us);
+    default:
+      return snprintf(buf, len, "%s,%g,%.1f", name, cfg->db, us);
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef __DSP_H
+#define __DSP_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+#define DSP_MAX_CHANNELS  8
+#define DSP_MAX_STRETCH   8       /* longest write (periods) i.e. BUFFER_1_8 */
+#define DSP_RAMP_DB_S     60.0f   /* gain block slew rate */
+#define DSP_LIMIT_REL_MS  100.0f  /* limiter release time */
+#define DSP_LOUD_WINDOW_S 3.0f    /* loudness averaging time */
+#define DSP_LOUD_SLEW_DB_S 3.0f   /* loudness gain slew rate */
+#define DSP_LOUD_MAX_DB   18.0f   /* most gain added by loudness block */
+#define DSP_LOUD_GATE_DB  -50.0f  /* quieter blocks don't change the gain */
+#define DSP_STATS         500     /* periods between verbose cost stats */
+
+/*
+ * Block specs (also used by the "E" UI command and --dsp):
+ *   peak,FREQ,GAIN_DB,Q     lowshelf,FREQ,GAIN_DB     highshelf,FREQ,GAIN_DB
+ *   lowpass,FREQ[,Q]        highpass,FREQ[,Q]         gain,GAIN_DB
+ *   limit[,THRESHOLD_DBFS]  loud[,TARGET_DBFS]
+ */
+int dsp_init(buffer_config_t *bc, settings_t *settings);
+void dsp_cleanup(buffer_config_t *bc);
+uint8_t *dsp_process(buffer_config_t *bc, uint8_t *data, unsigned int frames);
+int dsp_add(buffer_config_t *bc, const char *spec);
+int dsp_set(buffer_config_t *bc, unsigned int idx, const char *spec);
+int dsp_remove(buffer_config_t *bc, unsigned int idx);
+int dsp_clear(buffer_config_t *bc);
+int dsp_describe(buffer_config_t *bc, unsigned int idx, char *buf, size_t len);
+unsigned int dsp_num_blocks(buffer_config_t *bc);
+#endif
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "engine.h"
+#include "audio.h"
+#include "meter.h"
+#include "ring.h"
+#include "netout.h"
+#include "recorder.h"
+#include "dsp.h"
+#include "convert.h"
+#include "feed.h"
+#include "trace.h"
+#include "ui-server.h"
+
+/*
+ * Delay engine
+ *
+ * Everything between a configured audio source and the playback interface:
+ * the delay buffer, the audio thread with its delay control and processing,
+ * the UI command/status server and the other readers of the buffer.  The
+ * source is either a capture interface (nojoebuck.c) or the audio written
+ * to the ALSA plugin (pcm_nojoebuck.c).  One engine per process.
+ */
+
+static pthread_t audio_thread;
+static pthread_t ui_thread;
+static bool audio_started = false;
+static bool ui_started = false;
+
+/* buffer percentage (0-200) */
+int get_buf_pct(buffer_config_t *bc) {
+
+  int buf_pct = 0;
+  if (bc && !bc->target_delay_us) {
+    buf_pct = get_actual_delay_us(bc) ? 200 : 100;
+  }
+  else if (bc) {
+    buf_pct = (int)((get_actual_delay_us(bc) * 100.0) /
+                    bc->target_delay_us + 0.5);
+  }
+
+  /* Clip at 200 % */
+  if (buf_pct > 200) {
+    buf_pct = 200;
+  }
+
+  /* Round near 100 to stabalize the UI
+     Larger error at small deltas so round more
+   */
+  else if ((buf_pct >= 99 && buf_pct <= 101) ||
+      ((bc->target_delta_p < 200) &&
+       (buf_pct >= 96 && buf_pct <= 104))) {
+    buf_pct = 100;
+  }
+
+  return buf_pct;
+}
+
+/*
+ * Configure the playback interface for the source format already in bc
+ * (format, channels, rate and period).  Playback may differ from it in
+ * format, rate and channels; it is converted in one pass (convert.c).
+ */
+int engine_config_playback(settings_t *settings, buffer_config_t *bc) {
+
+  int ret;
+  unsigned int play_actual_rate, play_num_periods, play_period_time;
+  snd_pcm_uframes_t play_period_frames;
+
+  if ((ret = convert_init(bc, settings)) < 0) {
+    return ret;
+  }
+
+  if ((ret = configure_stream(bc->play_hndl, settings->play_format,
+                              settings->play_rate, bc->play_channels,
+                              &play_actual_rate, &play_period_time,
+                              &play_period_frames, &play_num_periods)) < 0) {
+    fprintf(stderr, "Error configureing playback interface\n");
+    return ret;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  bc->play_format = settings->play_format;
+  bc->play_rate = play_actual_rate;
+  bc->play_buffer_frames = play_period_frames * play_num_periods;
+  pthread_mutex_unlock(&bc->lock);
+
+  if ((ret = convert_start(bc, settings)) < 0) {
+    return ret;
+  }
+
+  if (settings->verbose) {
+    printf("  Playback Period (us):      %d\n", play_period_time);
+    printf("  Playback Period (frames):  %ld\n", play_period_frames);
+    printf("  Playback ALSA Num Periods: %d\n", play_num_periods);
+    printf("  Playback ALSA Buffer (ms): %.1f\n",
+           (bc->play_buffer_frames * 1000.0) / bc->play_rate);
+  }
+
+  return 0;
+}
+
+/*
+ * Allocate the delay buffer and start the engine threads.  The source and
+ * playback interface must be configured.  Everything started is stopped
+ * again on failure.
+ */
+int engine_start(buffer_config_t *bc, settings_t *settings) {
+
+  if (ring_init(bc, settings) < 0) {
+    return -ENOMEM;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  bc->min_delay_ms = (PERIODS_IN_ALSABUF * bc->period_time) / 1000;
+  bc->max_delay_ms = ((uint64_t)(bc->mem_num_periods - bc->write_ahead_p) *
+                      bc->period_time) / 1000;
+  bc->state = BUFFER_4_8;
+  bc->seek = settings->seek;
+  bc->target_delta_p = ((uint64_t)settings->delay_ms * 1000) /  bc->period_time;
+  bc->target_delay_us = (uint64_t)settings->delay_ms * 1000;
+  bc->quiet = calloc(bc->mem_num_periods, sizeof(uint8_t));
+  bc->cap_ns = calloc(bc->mem_num_periods, sizeof(uint64_t));
+  if (settings->quiet_dbfs) {
+    bc->quiet_energy = meter_quiet_threshold(settings->quiet_dbfs,
+        bc->period_frames * bc->channels);
+  }
+  pthread_mutex_unlock(&bc->lock);
+
+  if (!bc->quiet || !bc->cap_ns) {
+    fprintf(stderr, "Could allocate buffer memory\n");
+    goto fail;
+  }
+
+  if (dsp_init(bc, settings) < 0) {
+    goto fail;
+  }
+
+  if (trace_init(bc, settings) < 0) {
+    goto fail;
+  }
+
+  if(pthread_create(&audio_thread, NULL, audio_io_thread, bc)) {
+    fprintf(stderr, "Could not create audio I/O thread\n");
+    goto fail;
+  }
+  audio_started = true;
+
+  if (ui_init(bc, settings->ui_cmd, settings->ui_status) < 0) {
+    goto fail;
+  }
+
+  if (netout_init(bc, settings) < 0) {
+    goto fail;
+  }
+
+  if (recorder_init(bc, settings) < 0) {
+    goto fail;
+  }
+
+  if(pthread_create(&ui_thread, NULL, ui_server_thread, bc)) {
+    fprintf(stderr, "Could not create UI thread\n");
+    goto fail;
+  }
+  ui_started = true;
+
+  bc->verbose = settings->verbose;
+  return 0;
+
+fail:
+  engine_stop(bc);
+  return -1;
+}
+
+/* Stop the engine threads and free the delay buffer */
+void engine_stop(buffer_config_t *bc) {
+
+  bc->state = STOP;
+
+  if (ui_started) {
+    pthread_join(ui_thread, NULL);
+    ui_started = false;
+  }
+  ui_cleanup();
+  netout_cleanup(bc);
+
+  if (audio_started) {
+    pthread_join(audio_thread, NULL);
+    audio_started = false;
+  }
+  /* after the audio thread, which hands it played audio */
+  recorder_cleanup(bc);
+
+  trace_cleanup();
+  dsp_cleanup(bc);
+  convert_cleanup(bc);
+  free(bc->quiet);
+  free(bc->cap_ns);
+  bc->quiet = NULL;
+  bc->cap_ns = NULL;
+  ring_cleanup(bc);
+}
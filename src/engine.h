@@ -0,0 +1,10 @@
+#ifndef __ENGINE_H
+#define __ENGINE_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+int engine_config_playback(settings_t *settings, buffer_config_t *bc);
+int engine_start(buffer_config_t *bc, settings_t *settings);
+void engine_stop(buffer_config_t *bc);
+#endif
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "feed.h"
+
+/*
+ * Plugin audio source
+ *
+ * Takes the place of the capture interface when the engine runs inside the
+ * ALSA plugin (pcm_nojoebuck.c).  The application's writes are queued here
+ * (the plugin's "hardware" buffer) and the audio thread takes one period
+ * each time the system clock says a period has passed, just as a capture
+ * interface would deliver it.  When the application hasn't written enough
+ * the rest of the period is silence, so the delayed audio keeps playing
+ * out after the application stops or pauses.
+ *
+ * notify_fd (an eventfd the application polls) is signaled whenever space
+ * is freed.
+ */
+
+typedef struct feed {
+  pthread_mutex_t lock;
+  uint8_t *data;
+  snd_pcm_uframes_t size;   /* frames queued at most (application buffer) */
+  uint64_t written;         /* frames written by the application */
+  uint64_t read;            /* frames taken by the audio thread */
+  int notify_fd;
+
+  /* audio thread only */
+  uint64_t start_ns;        /* clock of the periods delivered */
+  uint64_t clock_frames;
+  uint64_t cap_ns;          /* capture time of the last period */
+} feed_t;
+
+#define FEED_MAX_LATE_NS  100000000ULL  /* restart the clock when this late */
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* copy 'frames' out of (to_ring false) or into the ring starting at 'pos' */
+static void ring_copy(buffer_config_t *bc, feed_t *fd, uint64_t pos,
+                      uint8_t *buf, snd_pcm_uframes_t frames, bool to_ring) {
+  snd_pcm_uframes_t off = pos % fd->size;
+  snd_pcm_uframes_t first = (off + frames > fd->size) ? fd->size - off : frames;
+  uint8_t *ring = fd->data + off * bc->frame_bytes;
+
+  if (to_ring) {
+    memcpy(ring, buf, first * bc->frame_bytes);
+    memcpy(fd->data, buf + first * bc->frame_bytes,
+           (frames - first) * bc->frame_bytes);
+  } else {
+    memcpy(buf, ring, first * bc->frame_bytes);
+    memcpy(buf + first * bc->frame_bytes, fd->data,
+           (frames - first) * bc->frame_bytes);
+  }
+}
+
+/*
+ * External Interface Functions
+ */
+int feed_init(buffer_config_t *bc, snd_pcm_uframes_t size, int notify_fd) {
+  feed_t *fd;
+
+  fd = calloc(1, sizeof(*fd));
+  if (!fd) {
+    return -ENOMEM;
+  }
+
+  fd->data = malloc(size * bc->frame_bytes);
+  if (!fd->data) {
+    free(fd);
+    return -ENOMEM;
+  }
+  fd->size = size;
+  fd->notify_fd = notify_fd;
+  pthread_mutex_init(&fd->lock, NULL);
+  bc->feed = fd;
+
+  return 0;
+}
+
+void feed_cleanup(buffer_config_t *bc) {
+  feed_t *fd = bc->feed;
+
+  if (!fd) {
+    return;
+  }
+
+  pthread_mutex_destroy(&fd->lock);
+  free(fd->data);
+  free(fd);
+  bc->feed = NULL;
+}
+
+/* drop queued audio and start counting from 0 again */
+void feed_reset(buffer_config_t *bc) {
+  feed_t *fd = bc->feed;
+
+  pthread_mutex_lock(&fd->lock);
+  fd->written = fd->read = 0;
+  pthread_mutex_unlock(&fd->lock);
+}
+
+/* queue application audio.  Returns the frames taken */
+snd_pcm_uframes_t feed_write(buffer_config_t *bc, const uint8_t *data,
+                             snd_pcm_uframes_t frames) {
+  feed_t *fd = bc->feed;
+  snd_pcm_uframes_t space;
+
+  pthread_mutex_lock(&fd->lock);
+  space = fd->size - (fd->written - fd->read);
+  frames = (frames < space) ? frames : space;
+  ring_copy(bc, fd, fd->written, (uint8_t *)data, frames, true);
+  fd->written += frames;
+  pthread_mutex_unlock(&fd->lock);
+
+  return frames;
+}
+
+snd_pcm_uframes_t feed_space(buffer_config_t *bc) {
+  feed_t *fd = bc->feed;
+  snd_pcm_uframes_t space;
+
+  pthread_mutex_lock(&fd->lock);
+  space = fd->size - (fd->written - fd->read);
+  pthread_mutex_unlock(&fd->lock);
+
+  return space;
+}
+
+/* frames taken by the audio thread since the last reset */
+uint64_t feed_consumed(buffer_config_t *bc) {
+  feed_t *fd = bc->feed;
+  uint64_t read;
+
+  pthread_mutex_lock(&fd->lock);
+  read = fd->read;
+  pthread_mutex_unlock(&fd->lock);
+
+  return read;
+}
+
+/*
+ * Audio thread: wait for the next period to be due and return it in dst.
+ * Returns period_frames.
+ */
+int feed_read(buffer_config_t *bc, uint8_t *dst) {
+  feed_t *fd = bc->feed;
+  snd_pcm_uframes_t frames = 0;
+  uint64_t now = mono_ns();
+  uint64_t due;
+  uint64_t one = 1;
+  struct timespec ts;
+
+  /* (re)start the clock on the first period or after falling behind */
+  due = fd->start_ns +
+        ((fd->clock_frames + bc->period_frames) * 1000000000ULL) / bc->rate;
+  if (!fd->start_ns || (now > due + FEED_MAX_LATE_NS)) {
+    fd->start_ns = now;
+    fd->clock_frames = 0;
+    due = now + (bc->period_frames * 1000000000ULL) / bc->rate;
+  }
+
+  ts.tv_sec = due / 1000000000ULL;
+  ts.tv_nsec = due % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+  pthread_mutex_lock(&fd->lock);
+  frames = fd->written - fd->read;
+  frames = (frames < bc->period_frames) ? frames : bc->period_frames;
+  ring_copy(bc, fd, fd->read, dst, frames, false);
+  fd->read += frames;
+  pthread_mutex_unlock(&fd->lock);
+
+  if (frames < bc->period_frames) {
+    snd_pcm_format_set_silence(bc->format, dst + frames * bc->frame_bytes,
+                               (bc->period_frames - frames) * bc->channels);
+  }
+  if (frames && (fd->notify_fd >= 0) &&
+      (write(fd->notify_fd, &one, sizeof(one)) < 0)) {
+    fprintf(stderr, "Warning: could not wake the application (%s)\n",
+            strerror(errno));
+  }
+
+  fd->clock_frames += bc->period_frames;
+  fd->cap_ns = due - (bc->period_frames * 1000000000ULL) / bc->rate;
+
+  return bc->period_frames;
+}
+
+/* CLOCK_MONOTONIC time the first frame of the last period was "captured" */
+uint64_t feed_captured_ns(buffer_config_t *bc) {
+  return bc->feed->cap_ns;
+}
@@ -0,0 +1,15 @@
+#ifndef __FEED_H
+#define __FEED_H
+
+#include "nojoebuck.h"
+
+int feed_init(buffer_config_t *bc, snd_pcm_uframes_t size, int notify_fd);
+void feed_cleanup(buffer_config_t *bc);
+void feed_reset(buffer_config_t *bc);
+snd_pcm_uframes_t feed_write(buffer_config_t *bc, const uint8_t *data,
+                             snd_pcm_uframes_t frames);
+snd_pcm_uframes_t feed_space(buffer_config_t *bc);
+uint64_t feed_consumed(buffer_config_t *bc);
+int feed_read(buffer_config_t *bc, uint8_t *dst);
+uint64_t feed_captured_ns(buffer_config_t *bc);
+#endif
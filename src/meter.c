@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+
+#include "meter.h"
+
+/*
+ * Peak and energy of every channel are gathered in a single pass over the
+ * period.  The loops are kept simple (no branches, no aliasing, independent
+ * accumulators) so the compiler can vectorize them.  Stereo gets its own
+ * loop since that is what is normally captured.
+ */
+static inline int32_t to_s16(int32_t v, unsigned int shift) {
+  /* S24_LE has 8 unused bits on top; shift them out first */
+  return (int32_t)((uint32_t)v << (16 - shift)) >> 16;
+}
+
+static void levels_s16_stereo(const int16_t *restrict s, unsigned int frames,
+                              meter_levels_t *levels) {
+  uint64_t sq0 = 0, sq1 = 0;
+  uint32_t pk0 = 0, pk1 = 0;
+  unsigned int i;
+
+  for (i = 0; i < frames; i++) {
+    int32_t l = s[2 * i];
+    int32_t r = s[2 * i + 1];
+    uint32_t al = (l < 0) ? -l : l;
+    uint32_t ar = (r < 0) ? -r : r;
+    sq0 += (uint32_t)(l * l);
+    sq1 += (uint32_t)(r * r);
+    pk0 = (al > pk0) ? al : pk0;
+    pk1 = (ar > pk1) ? ar : pk1;
+  }
+  levels->sumsq[0] = sq0;
+  levels->sumsq[1] = sq1;
+  levels->peak[0] = pk0;
+  levels->peak[1] = pk1;
+}
+
+static void levels_s32_stereo(const int32_t *restrict s, unsigned int frames,
+                              unsigned int shift, meter_levels_t *levels) {
+  uint64_t sq0 = 0, sq1 = 0;
+  uint32_t pk0 = 0, pk1 = 0;
+  unsigned int i;
+
+  for (i = 0; i < frames; i++) {
+    int32_t l = to_s16(s[2 * i], shift);
+    int32_t r = to_s16(s[2 * i + 1], shift);
+    uint32_t al = (l < 0) ? -l : l;
+    uint32_t ar = (r < 0) ? -r : r;
+    sq0 += (uint32_t)(l * l);
+    sq1 += (uint32_t)(r * r);
+    pk0 = (al > pk0) ? al : pk0;
+    pk1 = (ar > pk1) ? ar : pk1;
+  }
+  levels->sumsq[0] = sq0;
+  levels->sumsq[1] = sq1;
+  levels->peak[0] = pk0;
+  levels->peak[1] = pk1;
+}
+
+static void levels_any(snd_pcm_format_t format, unsigned int channels,
+                       const uint8_t *data, unsigned int frames,
+                       meter_levels_t *levels) {
+  unsigned int i, chan;
+  int32_t v;
+
+  for (i = 0; i < frames; i++) {
+    for (chan = 0; chan < channels; chan++) {
+      if (format == SND_PCM_FORMAT_S16_LE)
+        v = ((const int16_t *)data)[i * channels + chan];
+      else
+        v = to_s16(((const int32_t *)data)[i * channels + chan],
+                   (format == SND_PCM_FORMAT_S24_LE) ? 8 : 16);
+      levels->sumsq[chan] += (uint32_t)(v * v);
+      if ((uint32_t)abs(v) > levels->peak[chan])
+        levels->peak[chan] = abs(v);
+    }
+  }
+}
+
+/* Measure the levels of one period (levels is overwritten) */
+void meter_period(snd_pcm_format_t format, unsigned int channels,
+                  const uint8_t *data, unsigned int frames,
+                  meter_levels_t *levels) {
+  memset(levels, 0, sizeof(*levels));
+  levels->frames = frames;
+
+  if (channels > METER_MAX_CHANNELS)
+    channels = METER_MAX_CHANNELS;
+
+  if (channels != 2)
+    levels_any(format, channels, data, frames, levels);
+  else if (format == SND_PCM_FORMAT_S16_LE)
+    levels_s16_stereo((const int16_t *)data, frames, levels);
+  else if (format == SND_PCM_FORMAT_S24_LE)
+    levels_s32_stereo((const int32_t *)data, frames, 8, levels);
+  else
+    levels_s32_stereo((const int32_t *)data, frames, 16, levels);
+}
+
+/* Add the levels of one period to a running total */
+void meter_accumulate(meter_levels_t *total, const meter_levels_t *levels,
+                      unsigned int channels) {
+  unsigned int chan;
+
+  total->frames += levels->frames;
+  for (chan = 0; chan < channels && chan < METER_MAX_CHANNELS; chan++) {
+    total->sumsq[chan] += levels->sumsq[chan];
+    if (levels->peak[chan] > total->peak[chan])
+      total->peak[chan] = levels->peak[chan];
+  }
+}
+
+/* Sum of squared samples of all channels, scaled to 16-bit */
+uint64_t meter_energy(const meter_levels_t *levels, unsigned int channels) {
+  uint64_t energy = 0;
+  unsigned int chan;
+
+  for (chan = 0; chan < channels && chan < METER_MAX_CHANNELS; chan++)
+    energy += levels->sumsq[chan];
+
+  return energy;
+}
+
+/* Energy of 'samples' samples with an RMS level of 'dbfs' */
+uint64_t meter_quiet_threshold(int dbfs, unsigned int samples) {
+  return (uint64_t)(samples * 32768.0 * 32768.0 * pow(10.0, dbfs / 10.0));
+}
+
+static int db10(double ratio) {
+  if (ratio <= 0.0)
+    return METER_FLOOR_DB * 10;
+  ratio = 200.0 * log10(ratio);
+  return (ratio < METER_FLOOR_DB * 10) ? METER_FLOOR_DB * 10 : (int)ratio;
+}
+
+/* Peak level of a channel in 0.1 dBFS */
+int meter_peak_db10(const meter_levels_t *levels, unsigned int chan) {
+  return db10(levels->peak[chan] / 32768.0);
+}
+
+/* RMS level of a channel in 0.1 dBFS */
+int meter_rms_db10(const meter_levels_t *levels, unsigned int chan) {
+  if (!levels->frames)
+    return METER_FLOOR_DB * 10;
+  return db10(sqrt((double)levels->sumsq[chan] / levels->frames) / 32768.0) ;
+}
@@ -0,0 +1,29 @@
+#ifndef __METER_H
+#define __METER_H
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#define METER_MAX_CHANNELS  8
+#define METER_FLOOR_DB      -96  /* level reported for digital silence */
+
+/*
+ * Signal level measurement for captured periods.  Samples of every format
+ * are scaled to 16 bits so the results of different bit depths compare.
+ */
+typedef struct meter_levels {
+  unsigned int frames;                 /* frames accumulated */
+  uint32_t peak[METER_MAX_CHANNELS];   /* largest absolute sample */
+  uint64_t sumsq[METER_MAX_CHANNELS];  /* sum of squared samples */
+} meter_levels_t;
+
+void meter_period(snd_pcm_format_t format, unsigned int channels,
+                  const uint8_t *data, unsigned int frames,
+                  meter_levels_t *levels);
+void meter_accumulate(meter_levels_t *total, const meter_levels_t *levels,
+                      unsigned int channels);
+uint64_t meter_energy(const meter_levels_t *levels, unsigned int channels);
+uint64_t meter_quiet_threshold(int dbfs, unsigned int samples);
+int meter_peak_db10(const meter_levels_t *levels, unsigned int chan);
+int meter_rms_db10(const meter_levels_t *levels, unsigned int chan);
+#endif
@@ -0,0 +1,316 @@
+/* sendmmsg() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "ring.h"
+#include "netout.h"
+
+/*
+ * Network output
+ *
+ * Streams the delayed audio to any number of network clients as RTP over
+ * UDP (unicast or multicast addresses).  Each client reads the buffer
+ * through its own cursor which trails the capture pointer by the delay
+ * setting plus the client's offset, so it isn't affected by the speed
+ * changes of the local playback.
+ *
+ * Packets are sent straight out of the delay buffer (zero copy): each
+ * message is an RTP header plus a pointer into the buffer, and the packets
+ * for all clients are handed to the kernel with one sendmmsg() per period.
+ * The payload is the capture format as is (i.e. little endian S16_LE) with
+ * RTP payload type 96.
+ */
+
+typedef struct rtp_header {
+  uint8_t vpxcc;
+  uint8_t mpt;
+  uint16_t seq;
+  uint32_t timestamp;
+  uint32_t ssrc;
+} __attribute__((packed)) rtp_header_t;
+
+typedef struct net_client {
+  struct sockaddr_in addr;
+  int offset_ms;        /* delay relative to the delay setting */
+  uint16_t seq;
+  uint32_t timestamp;
+  uint32_t ssrc;
+  bool restart;         /* set marker bit on the next packet */
+} net_client_t;
+
+typedef struct netout {
+  int sock;
+  unsigned int num_clients;
+  net_client_t clients[NET_MAX_CLIENTS];
+  unsigned int packets;         /* packets per period */
+  unsigned int payload_bytes;   /* payload bytes of a full packet */
+  struct mmsghdr *msgs;
+  struct iovec *iov;
+  rtp_header_t *hdrs;
+  uint64_t sent;                /* periods sent (capture count) */
+  pthread_t thread;
+} netout_t;
+
+static netout_t *net = NULL;
+
+/* parse "HOST:PORT[,OFFSET_MS]" */
+static int parse_client(const char *spec, net_client_t *client) {
+  char host[MAX_NET_ADDR_LEN];
+  char *port, *offset;
+  struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+  struct addrinfo *res;
+  int err;
+
+  strncpy(host, spec, sizeof(host));
+  host[sizeof(host) - 1] = '\0';
+
+  if ((offset = strchr(host, ','))) {
+    *offset++ = '\0';
+    client->offset_ms = strtol(offset, NULL, 10);
+  }
+
+  if (!(port = strrchr(host, ':'))) {
+    fprintf(stderr, "Invalid network client '%s' (use HOST:PORT)\n", spec);
+    return -EINVAL;
+  }
+  *port++ = '\0';
+
+  if ((err = getaddrinfo(host, port, &hints, &res))) {
+    fprintf(stderr, "Invalid network client '%s' (%s)\n", spec,
+            gai_strerror(err));
+    return -EINVAL;
+  }
+  memcpy(&client->addr, res->ai_addr, sizeof(client->addr));
+  freeaddrinfo(res);
+
+  client->ssrc = random();
+  client->seq = random();
+  client->timestamp = random();
+  client->restart = true;
+
+  return 0;
+}
+
+/* queue the packets of one period for a client */
+static unsigned int queue_period(buffer_config_t *bc, net_client_t *client,
+                                 uint8_t *data, unsigned int msg) {
+  unsigned int pkt, bytes, offset;
+  rtp_header_t *hdr;
+
+  for (pkt = 0, offset = 0; offset < bc->period_bytes; pkt++, msg++) {
+    bytes = bc->period_bytes - offset;
+    if (bytes > net->payload_bytes) {
+      bytes = net->payload_bytes;
+    }
+
+    hdr = &net->hdrs[msg];
+    hdr->vpxcc = 0x80;                  /* RTP version 2 */
+    hdr->mpt = NET_PAYLOAD_TYPE | (client->restart ? 0x80 : 0);
+    hdr->seq = htons(client->seq++);
+    hdr->timestamp = htonl(client->timestamp);
+    hdr->ssrc = htonl(client->ssrc);
+    client->timestamp += bytes / bc->frame_bytes;
+    client->restart = false;
+
+    net->iov[2 * msg].iov_base = hdr;
+    net->iov[2 * msg].iov_len = sizeof(*hdr);
+    net->iov[2 * msg + 1].iov_base = data + offset;
+    net->iov[2 * msg + 1].iov_len = bytes;
+
+    memset(&net->msgs[msg], 0, sizeof(net->msgs[msg]));
+    net->msgs[msg].msg_hdr.msg_name = &client->addr;
+    net->msgs[msg].msg_hdr.msg_namelen = sizeof(client->addr);
+    net->msgs[msg].msg_hdr.msg_iov = &net->iov[2 * msg];
+    net->msgs[msg].msg_hdr.msg_iovlen = 2;
+
+    offset += bytes;
+  }
+
+  return pkt;
+}
+
+static void send_period(buffer_config_t *bc, unsigned int latest,
+                        unsigned int back) {
+  unsigned int i, msg = 0, sent;
+  int delay_p, period;
+  int ret;
+
+  for (i = 0; i < net->num_clients; i++) {
+    net_client_t *client = &net->clients[i];
+
+    /* this client's cursor: the delay setting (plus offset) behind capture */
+    delay_p = (int)bc->target_delta_p +
+              (client->offset_ms * 1000) / (int)bc->period_time;
+    if (delay_p < 0) {
+      delay_p = 0;
+    } else if (delay_p > (int)(bc->mem_num_periods - 2 - bc->write_ahead_p)) {
+      delay_p = bc->mem_num_periods - 2 - bc->write_ahead_p;
+    }
+    period = ((int)latest - (int)back - delay_p) % (int)bc->mem_num_periods;
+    if (period < 0) {
+      period += bc->mem_num_periods;
+    }
+
+    msg += queue_period(bc, client, ring_period_ptr(bc, period), msg);
+  }
+
+  for (sent = 0; sent < msg; sent += ret) {
+    ret = sendmmsg(net->sock, &net->msgs[sent], msg - sent, 0);
+    if (ret < 0) {
+      fprintf(stderr, "Network send failed (%s)\n", strerror(errno));
+      break;
+    }
+  }
+}
+
+static void *netout_thread(void *data) {
+  buffer_config_t *bc = (buffer_config_t *)data;
+  uint64_t count;
+  unsigned int latest, i;
+
+  while (bc->state) {
+    pthread_mutex_lock(&bc->lock);
+    while (bc->state && (bc->cap_count == net->sent)) {
+      pthread_cond_wait(&bc->captured, &bc->lock);
+    }
+    count = bc->cap_count;
+    pthread_mutex_unlock(&bc->lock);
+
+    /* capture pointer starts at period 0 and advances one period per count */
+    latest = (count - 1) % bc->mem_num_periods;
+
+    if (count - net->sent > NET_MAX_BACKLOG) {
+      fprintf(stderr, "Warning: network output fell behind; skipping %lld "
+              "periods\n", (long long)(count - net->sent - 1));
+      net->sent = count - 1;
+      for (i = 0; i < net->num_clients; i++) {
+        net->clients[i].restart = true;
+      }
+    }
+
+    /* send everything captured since last time, oldest first */
+    for (; net->sent < count; net->sent++) {
+      send_period(bc, latest, count - net->sent - 1);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * External Interface Functions
+ */
+int netout_init(buffer_config_t *bc, settings_t *settings) {
+  unsigned int i, slots;
+  unsigned char ttl = 1;
+
+  if (!settings->num_net) {
+    return 0;
+  }
+
+  if (bc->spill || bc->zring) {
+    fprintf(stderr, "Network output needs an uncompressed RAM buffer\n");
+    return -EINVAL;
+  }
+
+  net = calloc(1, sizeof(*net));
+  if (!net) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < settings->num_net; i++) {
+    if (parse_client(settings->net[i], &net->clients[i]) < 0) {
+      free(net);
+      net = NULL;
+      return -EINVAL;
+    }
+  }
+  net->num_clients = settings->num_net;
+
+  /* clients playing later than the delay setting read older periods */
+  pthread_mutex_lock(&bc->lock);
+  for (i = 0; i < net->num_clients; i++) {
+    int offset_p = (net->clients[i].offset_ms * 1000) / (int)bc->period_time;
+    if (offset_p > (int)bc->keep_extra_p) {
+      bc->keep_extra_p = offset_p;
+    }
+  }
+  pthread_mutex_unlock(&bc->lock);
+
+  net->payload_bytes = (NET_MAX_PAYLOAD / bc->frame_bytes) * bc->frame_bytes;
+  net->packets = (bc->period_bytes + net->payload_bytes - 1) / net->payload_bytes;
+  slots = net->num_clients * net->packets;
+  net->msgs = calloc(slots, sizeof(*net->msgs));
+  net->iov = calloc(2 * slots, sizeof(*net->iov));
+  net->hdrs = calloc(slots, sizeof(*net->hdrs));
+
+  net->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (!net->msgs || !net->iov || !net->hdrs || (net->sock < 0)) {
+    fprintf(stderr, "Could not set up network output\n");
+    goto err;
+  }
+  setsockopt(net->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+  pthread_mutex_lock(&bc->lock);
+  net->sent = bc->cap_count;
+  pthread_mutex_unlock(&bc->lock);
+
+  if (pthread_create(&net->thread, NULL, netout_thread, bc)) {
+    fprintf(stderr, "Could not create network output thread\n");
+    goto err;
+  }
+
+  if (settings->verbose) {
+    printf("Network output:\n");
+    for (i = 0; i < net->num_clients; i++) {
+      printf("  %s:%d  offset %d ms\n", inet_ntoa(net->clients[i].addr.sin_addr),
+             ntohs(net->clients[i].addr.sin_port), net->clients[i].offset_ms);
+    }
+    printf("  %d packets of up to %d bytes per period\n", net->packets,
+           net->payload_bytes);
+  }
+
+  return 0;
+
+err:
+  if (net->sock >= 0) {
+    close(net->sock);
+  }
+  free(net->msgs);
+  free(net->iov);
+  free(net->hdrs);
+  free(net);
+  net = NULL;
+  return -1;
+}
+
+void netout_cleanup(buffer_config_t *bc) {
+  if (!net) {
+    return;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  pthread_cond_broadcast(&bc->captured);
+  pthread_mutex_unlock(&bc->lock);
+  pthread_join(net->thread, NULL);
+
+  close(net->sock);
+  free(net->msgs);
+  free(net->iov);
+  free(net->hdrs);
+  free(net);
+  net = NULL;
+}
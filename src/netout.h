@@ -0,0 +1,13 @@
+#ifndef __NETOUT_H
+#define __NETOUT_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+#define NET_MAX_PAYLOAD   1280  /* RTP payload bytes per packet (fits MTU) */
+#define NET_PAYLOAD_TYPE  96    /* dynamic RTP payload type */
+#define NET_MAX_BACKLOG   50    /* periods to catch up before skipping ahead */
+
+int netout_init(buffer_config_t *bc, settings_t *settings);
+void netout_cleanup(buffer_config_t *bc);
+#endif
@@ -0,0 +1,134 @@
+#ifndef __NOJOEBUCK_CLIENT_H
+#define __NOJOEBUCK_CLIENT_H
+
+/*
+ * libnojoebuck-client: control and status of a running nojoebuck
+ *
+ * Wraps the ZMQ command/status protocol (see ui-server.c) so UIs don't
+ * have to poll sockets or parse messages themselves:
+ *
+ *   njb_t *njb = njb_open(NULL, NULL);
+ *   njb_subscribe(njb, "BD");
+ *   njb_query(njb, NJB_DELAY);
+ *   while (njb_wait(njb, -1, &status) >= 0) { ... }
+ *
+ * Delay changes sent with njb_set_delay() are coalesced: a burst of them
+ * (i.e. from turning an encoder) sends the first and then at most one
+ * every NJB_COALESCE_MS, always ending with the latest value.
+ *
+ * A level period set with njb_set_level_period() is a lease: the server
+ * reports at the fastest period any client holds and drops periods not
+ * renewed within NJB_LEVEL_LEASE_MS, so njb_wait() renews it while it waits.
+ *
+ * When nojoebuck runs with --tap, the delay buffer itself can be mapped
+ * read-only (njb_tap_open()) to follow the live or delayed audio without
+ * copies or another ALSA capture.
+ */
+
+#include <stdint.h>
+
+#define NJB_CMD_ENDPOINT    "ipc:///tmp/nojobuck_cmd"
+#define NJB_STATUS_ENDPOINT "ipc:///tmp/nojobuck_status"
+#define NJB_MAX_MSG         64
+#define NJB_MAX_LEVELS      16  /* peak & rms of up to 8 channels */
+#define NJB_COALESCE_MS     50
+#define NJB_LEVEL_LEASE_MS  5000  /* level periods lapse unless renewed */
+#define NJB_TAP_PATH        "/tmp/nojoebuck_tap"
+#define NJB_TAP_MAGIC       0x54424a4e  /* "NJBT" */
+#define NJB_TAP_VERSION     2
+
+typedef enum njb_topic {
+  NJB_ANY     = 0,
+  NJB_BUFFER  = 'B',  /* value: buffer fill 0-200 % */
+  NJB_CURRENT = 'C',  /* value: current delay in ms */
+  NJB_DELAY   = 'D',  /* value: delay setting in ms */
+  NJB_DSP     = 'E',  /* text: processing block */
+  NJB_LEVELS  = 'L',  /* levels: peak,rms per channel in 0.1 dBFS */
+  NJB_MEMORY  = 'M',  /* value: buffer RAM in KB */
+  NJB_RECORD  = 'R',  /* text: recorder status */
+  NJB_TIME    = 'T',  /* text: wall clock ms the audio playing was captured */
+  NJB_RATE    = 'U',  /* value: status rate limit in ms */
+} njb_topic_t;
+
+typedef struct njb_status {
+  njb_topic_t topic;
+  int value;
+  unsigned int num_levels;
+  int levels[NJB_MAX_LEVELS];
+  char text[NJB_MAX_MSG + 1];     /* everything after the ':' */
+} njb_status_t;
+
+/*
+ * Start of the shared delay buffer.  The audio follows at header_bytes and
+ * holds num_periods periods in the capture format.  Periods are counted
+ * from start: period 'seq' is at index seq % num_periods and is complete
+ * once cap_seq > seq.  Capture may write up to write_ahead periods past
+ * cap_seq before publishing them, so a period is being overwritten once
+ * cap_seq reaches seq + num_periods - write_ahead; check it's still valid
+ * (njb_tap_valid()) after reading it.  cap_seq is published last (atomic,
+ * release) with each new period.
+ */
+typedef struct njb_tap_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_bytes;    /* offset of the audio */
+  int32_t format;           /* snd_pcm_format_t */
+  uint32_t rate;
+  uint32_t channels;
+  uint32_t frame_bytes;
+  uint32_t period_frames;
+  uint32_t period_bytes;
+  uint32_t num_periods;     /* periods in the ring */
+  uint64_t cap_seq;         /* periods captured */
+  uint64_t play_seq;        /* period being played (delayed stream) */
+  uint64_t cap_ns;          /* CLOCK_MONOTONIC capture time of last period */
+  uint32_t write_ahead;     /* periods past cap_seq capture may be writing */
+} njb_tap_header_t;
+
+typedef struct njb njb_t;
+typedef struct njb_tap njb_tap_t;
+typedef void (*njb_callback_t)(const njb_status_t *status, void *ctx);
+
+/* NULL endpoints use the defaults (or $NOJOEBUCK_CMD / $NOJOEBUCK_STATUS) */
+njb_t *njb_open(const char *cmd_endpoint, const char *status_endpoint);
+void njb_close(njb_t *njb);
+
+/* topics: string of topic letters, i.e. "BDL", or "" for everything */
+int njb_subscribe(njb_t *njb, const char *topics);
+
+int njb_set_delay(njb_t *njb, unsigned int delay_ms);
+int njb_flush(njb_t *njb);
+int njb_query(njb_t *njb, njb_topic_t topic);
+int njb_set_level_period(njb_t *njb, unsigned int period_ms);
+int njb_set_rate_limit(njb_t *njb, unsigned int period_ms);
+int njb_command(njb_t *njb, const char *cmd);
+
+/* Also return from waits when fd becomes readable (i.e. stdin), -1 = off */
+void njb_set_wake_fd(njb_t *njb, int fd);
+
+/*
+ * Block up to timeout_ms (-1 = forever) for a status message.  Returns 1
+ * with *status filled in, 0 on timeout or wake fd, negative errno on error.
+ */
+int njb_wait(njb_t *njb, int timeout_ms, njb_status_t *status);
+
+/*
+ * Block up to timeout_ms for status, then call cb for every message
+ * queued.  Returns the number of messages handled or negative errno.
+ */
+int njb_dispatch(njb_t *njb, int timeout_ms, njb_callback_t cb, void *ctx);
+
+int njb_parse(const char *msg, int len, njb_status_t *status);
+
+/* Map the delay buffer of a nojoebuck started with --tap (NULL path =
+ * NJB_TAP_PATH).  Read only; doesn't need the command/status sockets */
+njb_tap_t *njb_tap_open(const char *path);
+void njb_tap_close(njb_tap_t *tap);
+const njb_tap_header_t *njb_tap_header(njb_tap_t *tap);
+uint64_t njb_tap_captured(njb_tap_t *tap);
+
+/* Period 'seq' or NULL if it isn't captured yet or was overwritten.
+ * Recheck with njb_tap_valid() once done with it */
+const uint8_t *njb_tap_period(njb_tap_t *tap, uint64_t seq);
+int njb_tap_valid(njb_tap_t *tap, uint64_t seq);
+#endif
@@ -1,92 +1,47 @@
 #include <stdio.h>
+#include <signal.h>
 #include <alsa/asoundlib.h>
 #include <systemd/sd-daemon.h>
 
 #include "nojoebuck.h"
 #include "settings.h"
 #include "audio.h"
-#include "ui-server.h"
-
-/* buffer percentage (0-200) */
-int get_buf_pct(buffer_config_t *bc) {
-
-  int buf_pct = 0;
-  if (bc) {
-    buf_pct = (int)((get_actual_delta(bc) * 100.0) /
-                    bc->target_delta_p + 0.5);
-  }
-
-  /* Clip at 200 % */
-  if (buf_pct > 200) {
-    buf_pct = 200;
-  }
-
-  /* Round near 100 to stabalize the UI
-     Larger error at small deltas so round more
-   */
-  else if ((buf_pct >= 99 && buf_pct <= 101) ||
-      ((bc->target_delta_p < 200) &&
-       (buf_pct >= 96 && buf_pct <= 104))) {
-    buf_pct = 100;
-  }
-
-  return buf_pct;
-}
-
-/* Make sure both streams can be configured identically */
+#include "engine.h"
+#include "trace.h"
+
+/*
+ * Configure the capture and playback streams.  They may differ in format,
+ * rate, channels and period size; the delay buffer holds the capture
+ * format and playback is converted from it (convert.c).
+ */
 int config_both_streams(settings_t *settings, buffer_config_t *bc) {
 
   int ret = -1;
-  unsigned int cap_actual_rate, play_actual_rate;
-  unsigned int cap_num_periods, play_num_periods;
-  unsigned int cap_period_time, play_period_time;
-  snd_pcm_uframes_t cap_period_frames, play_period_frames;
+  unsigned int cap_actual_rate;
+  unsigned int cap_num_periods;
+  unsigned int cap_period_time;
+  snd_pcm_uframes_t cap_period_frames;
 
-  if ((ret = configure_stream(bc->cap_hndl, settings->format, settings->rate,
+  if ((ret = configure_stream(bc->cap_hndl, settings->format, settings->rate, 2,
                               &cap_actual_rate, &cap_period_time,
                               &cap_period_frames, &cap_num_periods)) < 0) {
     fprintf(stderr, "Error configureing capture interface\n"); 
     return ret;
   }
 
-  if ((ret = configure_stream(bc->play_hndl, settings->format, settings->rate,
-                              &play_actual_rate, &play_period_time,
-                              &play_period_frames, &play_num_periods)) < 0) {
-    fprintf(stderr, "Error configureing playback interface\n"); 
-    return ret;
-  }
-
-  if (cap_actual_rate != play_actual_rate) {
-    fprintf(stderr, "Error: mismatch in bitrates.  cap: %d  play: %d\n",
-            cap_actual_rate, play_actual_rate);
-    return -1;
-  }
-
-  if (cap_num_periods != play_num_periods) {
-    fprintf(stderr, "Error: mismatch in num periods.  cap: %d  play: %d\n",
-            cap_num_periods, play_num_periods);
-    return -1;
-  }
-
-  if (cap_period_time != play_period_time) {
-    fprintf(stderr, "Error: mismatch in period time.  cap: %d  play: %d\n",
-            cap_period_time, play_period_time);
-    return -1;
-  }
-
-  if (cap_period_frames != play_period_frames) {
-    fprintf(stderr, "Error: mismatch in period frames.  cap: %ld  play: %ld\n",
-            cap_period_frames, play_period_frames);
-    return -1;
-  }
-
   pthread_mutex_lock(&bc->lock);
-  /* Frame size is 2 bytes (for 16-bit) * 2 chans */
-  bc->frame_bytes = (settings->bits / 8) * 2;
+  bc->format = settings->format;
+  bc->channels = 2;
+  bc->rate = cap_actual_rate;
+  /* Frame size is 2 bytes (for 16-bit) * 2 chans.  24-bit samples are
+   * stored in a 4 byte container (S24_LE) */
+  bc->frame_bytes = (snd_pcm_format_physical_width(bc->format) / 8) *
+                    bc->channels;
   bc->period_time = cap_period_time;
   bc->period_frames = cap_period_frames;
   bc->period_bytes = cap_period_frames * (bc->frame_bytes);
   bc->alsa_num_periods = cap_num_periods;
+  pthread_mutex_unlock(&bc->lock);
 
   if (settings->verbose) {
     printf("Audio Parameters:\n");
@@ -99,20 +54,24 @@ int config_both_streams(settings_t *settings, buffer_config_t *bc) {
     printf("  Calc ALSA Buffer (ms):     %.1f\n",
            (bc->alsa_num_periods * bc->period_time) / (1000.0));
   }
-  pthread_mutex_unlock(&bc->lock);
 
-  return 0;
+  return engine_config_playback(settings, bc);
+}
+
+/* SIGUSR1: dump the period trace */
+static void dump_trace(int sig) {
+  trace_dump_request();
 }
 
 int main(int argc, char *argv[]) {
 
   int ret;
   unsigned int try = 0;
-
-  pthread_t audio_thread;
-  pthread_t ui_thread;
+  sigset_t usr1;
+  struct sigaction sa = { .sa_handler = dump_trace };
 
   buffer_config_t buffer_config = { 0 };
+  pthread_cond_init(&buffer_config.captured, NULL);
 
   /* Default settings */
   settings_t settings = {
@@ -121,9 +80,13 @@ int main(int argc, char *argv[]) {
     .bits = 16,
     .rate = 48000,
     .memory = 32*1024*1024,
+    .spill_size = 2048ULL*1024*1024,
     .verbose = 0,
     .delay_ms = 5000,
     .wait = 0,
+    .seek = 0,
+    .quiet_dbfs = 0,
+    .trace_dir = "/tmp",
   };
 
   settings_get_opts(&settings, argc, argv);
@@ -168,44 +131,27 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  pthread_mutex_lock(&(buffer_config.lock));
-  buffer_config.min_delay_ms = (PERIODS_IN_ALSABUF * buffer_config.period_time) / 1000;
-  buffer_config.max_delay_ms = ((settings.memory / buffer_config.period_bytes) * buffer_config.period_time) / 1000;
-  buffer_config.state = BUFFER_4_8;
-  buffer_config.target_delta_p = (settings.delay_ms * 1000) /  buffer_config.period_time;
-  buffer_config.buffer = malloc(settings.memory);
-  buffer_config.mem_num_periods = settings.memory / buffer_config.period_bytes;
-  pthread_mutex_unlock(&(buffer_config.lock));
-
-  if (!buffer_config.buffer) {
-    fprintf(stderr, "Could allocate buffer memory\n");
-    exit(1);
-  }
-
-  if(pthread_create(&audio_thread, NULL, audio_io_thread, &buffer_config)) {
-    fprintf(stderr, "Could not create audio I/O thread\n");
-    goto cleanup;
-  }
+  /* SIGUSR1 is only taken by this thread so it doesn't interrupt audio I/O */
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, NULL);
 
-  if (ui_init(&buffer_config) < 0) {
-    goto cleanup;
+  if (engine_start(&buffer_config, &settings) < 0) {
+    exit(1);
   }
 
-  if(pthread_create(&ui_thread, NULL, ui_server_thread, &buffer_config)) {
-    fprintf(stderr, "Could not create UI thread\n");
-    goto join_audio;
-  }
+  sigaction(SIGUSR1, &sa, NULL);
+  pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
 
   if (settings.verbose) {
-    buffer_config.verbose = 1;
     printf("Buffer:\n");
-    printf("  Size:         %d MB\n", settings.memory/1024/1024);
+    printf("  Size:         %llu MB\n", (unsigned long long)settings.memory/1024/1024);
     printf("  Num Periods:  %d\n", buffer_config.mem_num_periods);
     printf("  Target Delay: %d ms\n", settings.delay_ms);
     printf("  Target Delay: %d periods\n  ", buffer_config.target_delta_p);
   }
 
-  printf("Max Delay:    %.1f seconds\n", (settings.memory / buffer_config.period_bytes) *
+  printf("Max Delay:    %.1f seconds\n", buffer_config.mem_num_periods *
                                          (buffer_config.period_time / 1000000.0));
 
   /* Notify systemd that we're ready */
@@ -220,12 +166,5 @@ int main(int argc, char *argv[]) {
   /* Notify systemd that we're done */
   sd_notify(0, "STOPPING=1");
 
-  pthread_join(ui_thread, NULL);
-  ui_cleanup();
-
-join_audio:
-  pthread_join(audio_thread, NULL);
-
-cleanup:
-  free(buffer_config.buffer);
+  engine_stop(&buffer_config);
 }
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <alsa/asoundlib.h>
 
+#include "meter.h"
+
 typedef enum playback_state {
   STOP       =  0,
   BUFFER_1_8 =  1,
@@ -31,27 +33,63 @@ typedef enum playback_state {
   (x == PURGE_12_8)?"PURGE 150%": \
   (x == PURGE_16_8)?"PURGE 200%": "PURGE 400%"
 
+/* unsolicited messages go to stdout, which belongs to the application when
+ * the engine runs in the ALSA plugin (only printed there with verbose) */
+#define CAN_PRINT(x) (!(x)->feed || (x)->verbose)
+
 typedef struct buffer_config {
   /* unprotected paramters (only set once) */
   bool verbose;;
+  bool seek;                       /* Jump play cursor instead of stretching */
   snd_pcm_t *cap_hndl;
+  struct feed *feed;               /* ALSA plugin source (feed.c) or NULL */
   snd_pcm_t *play_hndl;
   unsigned int alsa_num_periods;   /* Number of periods in ALSA buffer */
   unsigned int mem_num_periods;    /* Number of periods in app memory buffer */
   unsigned int period_time;        /* period length in uS */
   snd_pcm_uframes_t period_bytes;  /* size of period in bytes */
   unsigned int frame_bytes;        /* size of frame in bytes */
+  snd_pcm_format_t format;         /* sample format */
+  unsigned int channels;           /* number of channels */
+  unsigned int rate;               /* sample rate */
   snd_pcm_uframes_t period_frames; /* number of frames in a period */
+  snd_pcm_format_t play_format;    /* playback sample format */
+  unsigned int play_channels;      /* playback channels */
+  unsigned int play_rate;          /* playback sample rate */
+  unsigned int play_frame_bytes;   /* size of playback frame in bytes */
+  snd_pcm_uframes_t play_buffer_frames; /* size of ALSA playback buffer */
+  struct convert *convert;         /* capture to playback conversion or NULL */
   unsigned int min_delay_ms;       /* 5 ALSA periods */
   unsigned int max_delay_ms;       /* Max delay (based on app memory) */
+  uint64_t quiet_energy;           /* Periods below this energy are quiet (0=off) */
 
   /* Paramenters protected by lock */
   pthread_mutex_t lock;  
   uint8_t *buffer;      /* Application memory buffer for time delay */
+  size_t buffer_bytes;  /* size of buffer (address space, see ring.c) */
+  bool magic;           /* buffer is mapped twice back to back (ring.c) */
+  int buffer_fd;        /* memfd behind a double mapped buffer */
+  struct spill *spill;  /* Disk backed buffer (ring.c) or NULL if RAM only */
+  struct zring *zring;  /* Compressed buffer (ring.c) or NULL if uncompressed */
+  struct elastic *elastic;  /* RAM commit tracking (ring.c) or NULL if fixed */
+  struct tap *tap;      /* Shared memory tap (tap.c) or NULL if private */
+  unsigned int keep_p;  /* periods behind capture still held in the buffer */
+  unsigned int keep_extra_p;  /* periods beyond the delay other readers need */
+  unsigned int write_ahead_p; /* periods past cap capture may be writing (a
+                                 multi-period read); not stable for readers */
   unsigned int play;    /* playback period number (0 - mem_num_periods-1) */
   unsigned int cap;     /* capture period number (0 - mem_num_periods-1) */
+  uint8_t *quiet;       /* per period flag: period is quiet (silence aware catch-up) */
+  uint64_t *cap_ns;     /* per period CLOCK_MONOTONIC capture time of 1st frame */
+  unsigned int quiet_p; /* number of quiet periods between play and cap */
+  meter_levels_t levels;  /* capture levels accumulated since last UI report */
+  meter_levels_t levels_query; /* same, since the last "L:" request */
+  uint64_t cap_count;     /* periods captured since start */
+  pthread_cond_t captured;  /* signaled each time a period is captured */
+  struct dsp *dsp;        /* playback processing chain (dsp.c) */
 
   unsigned int target_delta_p; /* target delta in periods */
+  uint64_t target_delay_us;    /* target delay (capture to playback) */
 
   playback_state_t state;
 } buffer_config_t;
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#include "pcm.h"
+
+/*
+ * Build 'frames' frames in dst which start out as 'from' and are linearly
+ * crossfaded to 'to' over the first 'xfade_frames' frames.  Either source
+ * may be NULL to fade from/to silence.  dst may not overlap the sources.
+ */
+void pcm_crossfade(snd_pcm_format_t format, unsigned int channels,
+                   uint8_t *dst, const uint8_t *from, const uint8_t *to,
+                   unsigned int frames, unsigned int xfade_frames) {
+  unsigned int frame, chan, idx;
+  int64_t in_gain;   /* Q15 gain applied to 'to' */
+  int64_t a, b;
+
+  if (xfade_frames > frames)
+    xfade_frames = frames;
+
+  for (frame = 0; frame < frames; frame++) {
+    in_gain = (frame < xfade_frames) ?
+              ((int64_t)frame << 15) / xfade_frames : (1 << 15);
+
+    for (chan = 0; chan < channels; chan++) {
+      idx = frame * channels + chan;
+      a = from ? pcm_get_sample(format, from, idx) : 0;
+      b = to ? pcm_get_sample(format, to, idx) : 0;
+      pcm_put_sample(format, dst, idx,
+                     (int32_t)((a * ((1 << 15) - in_gain) + b * in_gain) >> 15));
+    }
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef __PCM_H
+#define __PCM_H
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Sample level helpers for the interleaved signed formats nojoebuck
+ * supports (S16_LE, S24_LE in a 32-bit container and S32_LE).
+ */
+
+static inline int32_t pcm_get_sample(snd_pcm_format_t format,
+                                     const uint8_t *data, unsigned int idx) {
+  if (format == SND_PCM_FORMAT_S16_LE)
+    return ((const int16_t *)data)[idx];
+  if (format == SND_PCM_FORMAT_S24_LE)
+    return ((int32_t)((uint32_t)((const int32_t *)data)[idx] << 8)) >> 8;
+  return ((const int32_t *)data)[idx];
+}
+
+static inline void pcm_put_sample(snd_pcm_format_t format, uint8_t *data,
+                                  unsigned int idx, int32_t value) {
+  if (format == SND_PCM_FORMAT_S16_LE)
+    ((int16_t *)data)[idx] = value;
+  else
+    ((int32_t *)data)[idx] = value;
+}
+
+void pcm_crossfade(snd_pcm_format_t format, unsigned int channels,
+                   uint8_t *dst, const uint8_t *from, const uint8_t *to,
+                   unsigned int frames, unsigned int xfade_frames);
+#endif
@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "engine.h"
+#include "convert.h"
+#include "feed.h"
+
+/*
+ * ALSA plugin: "type nojoebuck" playback PCM
+ *
+ * Runs the delay engine inside the application, with the application's
+ * writes as the source in place of a capture interface (feed.c) and the
+ * slave PCM as the playback interface:
+ *
+ *   pcm.delayed {
+ *     type nojoebuck
+ *     slave "hw:0"       # playback PCM (default "default")
+ *     delay 5000         # initial delay in ms
+ *     memory 32          # delay buffer in MB
+ *     rate 48000         # slave rate and bits if they should differ
+ *     bits 24
+ *     seek false         # as --seek and --quiet of the daemon
+ *     quiet -45
+ *     cmd "ipc:///tmp/nojoebuck_plugin_cmd"       # UI endpoints (default
+ *     status "ipc:///tmp/nojoebuck_plugin_status" # as the daemon)
+ *     verbose false
+ *   }
+ *
+ * The delay is controlled through the same ZMQ commands as the daemon, so
+ * the UIs work unchanged (point them at the plugin's endpoints if the
+ * daemon is running too).  The engine is started by the first prepare and
+ * restarted if the application changes format, rate or period size.  One
+ * nojoebuck PCM per process.
+ */
+
+#define NJ_MIN_PERIOD_BYTES  256
+#define NJ_MAX_PERIOD_BYTES  (64 * 1024)
+#define NJ_MAX_BUFFER_BYTES  (1024 * 1024)
+
+typedef struct snd_pcm_nojoebuck {
+  snd_pcm_ioplug_t io;
+  buffer_config_t bc;
+  settings_t settings;
+  unsigned int slave_rate;    /* 0 = the application's rate */
+  unsigned int slave_bits;    /* 0 = the application's format */
+  int event_fd;               /* readable when the application can write */
+  snd_pcm_uframes_t buffer_size;
+  bool running;               /* engine started */
+} snd_pcm_nojoebuck_t;
+
+static bool in_use = false;
+
+static void wake_app(snd_pcm_nojoebuck_t *nj) {
+  uint64_t one = 1;
+
+  if (write(nj->event_fd, &one, sizeof(one)) < 0) {
+    SNDERR("nojoebuck: could not wake application");
+  }
+}
+
+static void engine_down(snd_pcm_nojoebuck_t *nj) {
+  if (!nj->running) {
+    return;
+  }
+  engine_stop(&nj->bc);
+  feed_cleanup(&nj->bc);
+  snd_pcm_drop(nj->bc.play_hndl);
+  nj->running = false;
+}
+
+/* start the engine for the parameters the application chose */
+static int engine_up(snd_pcm_nojoebuck_t *nj) {
+  snd_pcm_ioplug_t *io = &nj->io;
+  buffer_config_t *bc = &nj->bc;
+  settings_t *settings = &nj->settings;
+  snd_pcm_t *slave = bc->play_hndl;
+  int err;
+
+  memset(bc, 0, sizeof(*bc));
+  pthread_mutex_init(&bc->lock, NULL);
+  pthread_cond_init(&bc->captured, NULL);
+
+  if (!slave &&
+      ((err = snd_pcm_open(&slave, settings->play_int,
+                           SND_PCM_STREAM_PLAYBACK, 0)) < 0)) {
+    SNDERR("nojoebuck: cannot open slave %s (%s)", settings->play_int,
+           snd_strerror(err));
+    return err;
+  }
+  bc->play_hndl = slave;
+
+  bc->format = io->format;
+  bc->channels = io->channels;
+  bc->rate = io->rate;
+  bc->frame_bytes = (snd_pcm_format_physical_width(bc->format) / 8) *
+                    bc->channels;
+  bc->period_frames = io->period_size;
+  bc->period_bytes = bc->period_frames * bc->frame_bytes;
+  bc->period_time = ((uint64_t)bc->period_frames * 1000000) / bc->rate;
+  bc->alsa_num_periods = io->buffer_size / io->period_size;
+
+  /* the slave plays the application's format unless configured otherwise */
+  settings->format = io->format;
+  settings->rate = io->rate;
+  settings->play_rate = nj->slave_rate ? nj->slave_rate : io->rate;
+  if (nj->slave_bits == 16)
+    settings->play_format = SND_PCM_FORMAT_S16_LE;
+  else if (nj->slave_bits == 24)
+    settings->play_format = SND_PCM_FORMAT_S24_LE;
+  else if (nj->slave_bits == 32)
+    settings->play_format = SND_PCM_FORMAT_S32_LE;
+  else
+    settings->play_format = io->format;
+
+  if ((err = engine_config_playback(settings, bc)) < 0) {
+    convert_cleanup(bc);
+    return err;
+  }
+
+  if ((err = feed_init(bc, io->buffer_size, nj->event_fd)) < 0) {
+    convert_cleanup(bc);
+    return err;
+  }
+
+  if (engine_start(bc, settings) < 0) {
+    feed_cleanup(bc);
+    return -EIO;
+  }
+
+  nj->buffer_size = io->buffer_size;
+  nj->running = true;
+  return 0;
+}
+
+/*
+ * ioplug callbacks
+ */
+static int nj_start(snd_pcm_ioplug_t *io) {
+  return 0;
+}
+
+static int nj_stop(snd_pcm_ioplug_t *io) {
+  snd_pcm_nojoebuck_t *nj = io->private_data;
+
+  /* drop what hasn't been taken yet; the delay buffer plays out */
+  if (nj->running) {
+    feed_reset(&nj->bc);
+  }
+  return 0;
+}
+
+static snd_pcm_sframes_t nj_pointer(snd_pcm_ioplug_t *io) {
+  snd_pcm_nojoebuck_t *nj = io->private_data;
+
+  if (!nj->running) {
+    return 0;
+  }
+  return feed_consumed(&nj->bc) % io->buffer_size;
+}
+
+static snd_pcm_sframes_t nj_transfer(snd_pcm_ioplug_t *io,
+                                     const snd_pcm_channel_area_t *areas,
+                                     snd_pcm_uframes_t offset,
+                                     snd_pcm_uframes_t size) {
+  snd_pcm_nojoebuck_t *nj = io->private_data;
+  const uint8_t *data = (const uint8_t *)areas->addr +
+                        (areas->first + areas->step * offset) / 8;
+
+  if (!nj->running) {
+    return -EBADFD;
+  }
+  return feed_write(&nj->bc, data, size);
+}
+
+static int nj_prepare(snd_pcm_ioplug_t *io) {
+  snd_pcm_nojoebuck_t *nj = io->private_data;
+  buffer_config_t *bc = &nj->bc;
+  int err;
+
+  if (nj->running &&
+      ((bc->format != io->format) || (bc->rate != io->rate) ||
+       (bc->channels != io->channels) ||
+       (bc->period_frames != io->period_size) ||
+       (nj->buffer_size != io->buffer_size))) {
+    engine_down(nj);
+  }
+
+  if (!nj->running && ((err = engine_up(nj)) < 0)) {
+    return err;
+  }
+
+  feed_reset(bc);
+  wake_app(nj);
+  return 0;
+}
+
+static int nj_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
+                           unsigned int nfds, unsigned short *revents) {
+  snd_pcm_nojoebuck_t *nj = io->private_data;
+  uint64_t val;
+
+  /* clear the wakeup (non-blocking, so nothing to clear is fine) */
+  if ((read(nj->event_fd, &val, sizeof(val)) < 0) && (errno != EAGAIN)) {
+    SNDERR("nojoebuck: poll failed");
+  }
+
+  *revents = (nj->running && feed_space(&nj->bc)) ? POLLOUT : 0;
+  return 0;
+}
+
+static int nj_close(snd_pcm_ioplug_t *io) {
+  snd_pcm_nojoebuck_t *nj = io->private_data;
+
+  engine_down(nj);
+  if (nj->bc.play_hndl) {
+    snd_pcm_close(nj->bc.play_hndl);
+  }
+  close(nj->event_fd);
+  free(nj);
+  in_use = false;
+
+  return 0;
+}
+
+static const snd_pcm_ioplug_callback_t nj_callback = {
+  .start = nj_start,
+  .stop = nj_stop,
+  .pointer = nj_pointer,
+  .transfer = nj_transfer,
+  .prepare = nj_prepare,
+  .poll_revents = nj_poll_revents,
+  .close = nj_close,
+};
+
+static int nj_constraints(snd_pcm_ioplug_t *io) {
+  static const unsigned int access_list[] = { SND_PCM_ACCESS_RW_INTERLEAVED };
+  static const unsigned int format_list[] = {
+    SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S32_LE,
+  };
+  int err;
+
+  if (((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS,
+                                            1, access_list)) < 0) ||
+      ((err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT,
+                                            3, format_list)) < 0) ||
+      ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_CHANNELS,
+                                              2, 2)) < 0) ||
+      ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE,
+                                              8000, 192000)) < 0) ||
+      ((err = snd_pcm_ioplug_set_param_minmax(io,
+                                              SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+                                              NJ_MIN_PERIOD_BYTES,
+                                              NJ_MAX_PERIOD_BYTES)) < 0) ||
+      ((err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIODS,
+                                              2, 64)) < 0) ||
+      ((err = snd_pcm_ioplug_set_param_minmax(io,
+                                              SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+                                              2 * NJ_MIN_PERIOD_BYTES,
+                                              NJ_MAX_BUFFER_BYTES)) < 0)) {
+    return err;
+  }
+
+  return 0;
+}
+
+static int get_string(snd_config_t *n, char *dst, size_t len) {
+  const char *str;
+
+  if (snd_config_get_string(n, &str) < 0) {
+    return -EINVAL;
+  }
+  snprintf(dst, len, "%s", str);
+  return 0;
+}
+
+static int parse_conf(snd_config_t *conf, snd_pcm_nojoebuck_t *nj) {
+  settings_t *settings = &nj->settings;
+  snd_config_iterator_t i, next;
+  snd_config_t *n;
+  const char *id;
+  long v;
+  int err = 0;
+
+  snd_config_for_each(i, next, conf) {
+    n = snd_config_iterator_entry(i);
+    if (snd_config_get_id(n, &id) < 0) {
+      continue;
+    }
+    if (!strcmp(id, "comment") || !strcmp(id, "type") || !strcmp(id, "hint")) {
+      continue;
+    }
+
+    if (!strcmp(id, "slave")) {
+      err = get_string(n, settings->play_int, MAX_AUDIO_DEVNAME_LEN);
+    } else if (!strcmp(id, "cmd")) {
+      err = get_string(n, settings->ui_cmd, MAX_PATH_LEN);
+    } else if (!strcmp(id, "status")) {
+      err = get_string(n, settings->ui_status, MAX_PATH_LEN);
+    } else if (!strcmp(id, "trace")) {
+      err = get_string(n, settings->trace_dir, MAX_PATH_LEN);
+    } else if (!strcmp(id, "delay") && !(err = snd_config_get_integer(n, &v))) {
+      settings->delay_ms = v;
+    } else if (!strcmp(id, "memory") && !(err = snd_config_get_integer(n, &v))) {
+      settings->memory = (uint64_t)v * 1024 * 1024;
+    } else if (!strcmp(id, "rate") && !(err = snd_config_get_integer(n, &v))) {
+      nj->slave_rate = v;
+    } else if (!strcmp(id, "bits") && !(err = snd_config_get_integer(n, &v))) {
+      if ((v != 16) && (v != 24) && (v != 32)) {
+        err = -EINVAL;
+      }
+      nj->slave_bits = v;
+    } else if (!strcmp(id, "quiet") && !(err = snd_config_get_integer(n, &v))) {
+      settings->quiet_dbfs = v;
+    } else if (!strcmp(id, "seek")) {
+      err = snd_config_get_bool(n);
+      settings->seek = (err > 0);
+    } else if (!strcmp(id, "verbose")) {
+      err = snd_config_get_bool(n);
+      settings->verbose = (err > 0);
+    } else {
+      SNDERR("nojoebuck: unknown field %s", id);
+      return -EINVAL;
+    }
+
+    if (err < 0) {
+      SNDERR("nojoebuck: invalid value for %s", id);
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+SND_PCM_PLUGIN_DEFINE_FUNC(nojoebuck) {
+  snd_pcm_nojoebuck_t *nj;
+  int err;
+
+  if (stream != SND_PCM_STREAM_PLAYBACK) {
+    SNDERR("nojoebuck: only playback is supported");
+    return -EINVAL;
+  }
+  if (in_use) {
+    SNDERR("nojoebuck: only one nojoebuck PCM per process");
+    return -EBUSY;
+  }
+
+  nj = calloc(1, sizeof(*nj));
+  if (!nj) {
+    return -ENOMEM;
+  }
+
+  /* same defaults as the daemon */
+  strcpy(nj->settings.play_int, "default");
+  nj->settings.memory = 32*1024*1024;
+  nj->settings.delay_ms = 5000;
+  strcpy(nj->settings.trace_dir, "/tmp");
+
+  if ((err = parse_conf(conf, nj)) < 0) {
+    free(nj);
+    return err;
+  }
+
+  nj->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (nj->event_fd < 0) {
+    err = -errno;
+    free(nj);
+    return err;
+  }
+
+  nj->io.version = SND_PCM_IOPLUG_VERSION;
+  nj->io.name = "nojoebuck delay";
+  nj->io.callback = &nj_callback;
+  nj->io.private_data = nj;
+  nj->io.poll_fd = nj->event_fd;
+  nj->io.poll_events = POLLIN;
+  nj->io.mmap_rw = 0;
+
+  if ((err = snd_pcm_ioplug_create(&nj->io, name, stream, mode)) < 0) {
+    close(nj->event_fd);
+    free(nj);
+    return err;
+  }
+
+  if ((err = nj_constraints(&nj->io)) < 0) {
+    snd_pcm_ioplug_delete(&nj->io);
+    return err;
+  }
+
+  in_use = true;
+  *pcmp = nj->io.pcm;
+  return 0;
+}
+
+SND_PCM_PLUGIN_SYMBOL(nojoebuck);
@@ -0,0 +1,591 @@
+/* sync_file_range() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "ring.h"
+#include "codec.h"
+#include "recorder.h"
+
+/*
+ * Recorder
+ *
+ * Archives the audio to WAV or FLAC files in the record directory, either
+ * live (as captured) or delayed (as played).  Recording is started and
+ * stopped by UI commands.
+ *
+ * A live recording reads the delay buffer through its own cursor on a low
+ * priority thread and never blocks the audio thread.  If the disk is slow
+ * it falls behind within the delay buffer (or by up to REC_MAX_LAG_MS of an
+ * elastic buffer); only when the capture pointer catches up with the cursor
+ * is audio lost (with a warning).
+ *
+ * A delayed recording is exactly what write_frames() (audio.c) passes to
+ * ALSA, in the playback format: speed changes, seek splices and silence,
+ * quiet period drops and repeats, the dsp chain and the conversion are all
+ * in it.  The audio thread copies it into a single producer, single
+ * consumer ring of REC_PLAYED_MS without locking (recorder_played()); audio
+ * that finds the ring full is dropped and reported as lost.
+ *
+ * Audio is gathered into a large buffer and written in aligned multiples of
+ * REC_ALIGN.  Written ranges are pushed to disk and dropped from the page
+ * cache so a long recording doesn't fill the Pi's memory with dirty pages.
+ */
+
+#define WAV_HEADER_BYTES  68
+
+typedef struct recorder {
+  char dir[MAX_PATH_LEN];
+  bool flac;
+  pthread_t thread;
+
+  /* protected by bc->lock */
+  rec_source_t want;            /* requested by the UI */
+  rec_source_t source;          /* being recorded */
+  char name[MAX_REC_NAME];
+
+  /* recorder thread only */
+  int fd;
+  uint64_t next;                /* capture sequence of next period */
+  snd_pcm_format_t format;      /* format of the file */
+  unsigned int channels;
+  unsigned int rate;
+  unsigned int frame_bytes;
+  unsigned int block_frames;    /* frames per FLAC frame */
+  uint64_t blocks;              /* blocks (FLAC frames) in the file */
+  uint64_t frames;              /* frames in the file */
+  uint64_t lost;                /* frames lost to overruns */
+  uint8_t *batch;               /* REC_BATCH_BYTES, aligned */
+  size_t used;                  /* bytes in batch */
+  size_t period_max;            /* max bytes a period adds to batch */
+  off_t off;                    /* file offset of batch */
+  off_t prev_off;               /* previous write (for page cache drop) */
+  size_t prev_len;
+
+  /* played audio, audio thread to recorder thread */
+  uint8_t *played;              /* played_frames of playback audio */
+  unsigned int played_frames;
+  unsigned int play_block;      /* playback frames per period */
+  uint8_t *wrapped;             /* a block that wraps the ring, joined */
+  uint64_t played_head;         /* frames added (audio thread) */
+  uint64_t played_tail;         /* frames taken (recorder thread) */
+  uint64_t played_lost;         /* frames dropped while full */
+} recorder_t;
+
+static recorder_t *rec = NULL;
+static bool played_on = false;  /* audio thread hands played audio over */
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  put_le16(p, v);
+  put_le16(p + 2, v >> 16);
+}
+
+/* WAVE_FORMAT_EXTENSIBLE header (needed for 24 bits in 32 bit containers) */
+static void wav_header(uint64_t data_bytes, uint8_t *out) {
+  static const uint8_t pcm_guid[16] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+                                        0x10, 0x00, 0x80, 0x00, 0x00, 0xaa,
+                                        0x00, 0x38, 0x9b, 0x71 };
+
+  if (data_bytes > UINT32_MAX - WAV_HEADER_BYTES) {
+    data_bytes = UINT32_MAX - WAV_HEADER_BYTES;
+  }
+
+  memcpy(out, "RIFF", 4);
+  put_le32(out + 4, WAV_HEADER_BYTES - 8 + data_bytes);
+  memcpy(out + 8, "WAVEfmt ", 8);
+  put_le32(out + 16, 40);
+  put_le16(out + 20, 0xfffe);
+  put_le16(out + 22, rec->channels);
+  put_le32(out + 24, rec->rate);
+  put_le32(out + 28, rec->rate * rec->frame_bytes);
+  put_le16(out + 32, rec->frame_bytes);
+  put_le16(out + 34, snd_pcm_format_physical_width(rec->format));
+  put_le16(out + 36, 22);
+  put_le16(out + 38, snd_pcm_format_width(rec->format));
+  put_le32(out + 40, (rec->channels == 2) ? 0x3 : 0);
+  memcpy(out + 44, pcm_guid, 16);
+  memcpy(out + 60, "data", 4);
+  put_le32(out + 64, data_bytes);
+}
+
+/* write the aligned part of the batch (or all of it) */
+static void rec_write(buffer_config_t *bc, bool all) {
+  size_t len = all ? rec->used : (rec->used / REC_ALIGN) * REC_ALIGN;
+  ssize_t ret;
+
+  if (!len) {
+    return;
+  }
+
+  ret = pwrite(rec->fd, rec->batch, len, rec->off);
+  if (ret != len) {
+    fprintf(stderr, "Recorder write failed (%s)\n",
+            (ret < 0) ? strerror(errno) : "short write");
+  }
+
+  /* start writeback now, then wait for the previous write to be on disk
+   * and drop it from the page cache */
+  sync_file_range(rec->fd, rec->off, len, SYNC_FILE_RANGE_WRITE);
+  if (rec->prev_len) {
+    sync_file_range(rec->fd, rec->prev_off, rec->prev_len,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(rec->fd, rec->prev_off, rec->prev_len, POSIX_FADV_DONTNEED);
+  }
+  rec->prev_off = rec->off;
+  rec->prev_len = len;
+
+  rec->off += len;
+  rec->used -= len;
+  memmove(rec->batch, rec->batch + len, rec->used);
+}
+
+static int rec_open(buffer_config_t *bc, rec_source_t source) {
+  char path[MAX_PATH_LEN + MAX_REC_NAME + 1];
+  char stamp[20];
+  time_t now = time(NULL);
+  struct tm tm;
+  int ret;
+
+  localtime_r(&now, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+  pthread_mutex_lock(&bc->lock);
+  snprintf(rec->name, MAX_REC_NAME, "nojoebuck-%s-%s.%s", stamp,
+           REC_SOURCE_NAME(source), rec->flac ? "flac" : "wav");
+  pthread_mutex_unlock(&bc->lock);
+  snprintf(path, sizeof(path), "%s/%s", rec->dir, rec->name);
+
+  rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+  if (rec->fd < 0) {
+    fprintf(stderr, "cannot open recording %s (%s)\n", path, strerror(errno));
+    return -errno;
+  }
+  posix_fadvise(rec->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (source == REC_DELAYED) {
+    rec->format = bc->play_format;
+    rec->channels = bc->play_channels;
+    rec->rate = bc->play_rate;
+    rec->frame_bytes = bc->play_frame_bytes;
+    rec->block_frames = rec->play_block;
+  } else {
+    rec->format = bc->format;
+    rec->channels = bc->channels;
+    rec->rate = bc->rate;
+    rec->frame_bytes = bc->frame_bytes;
+    rec->block_frames = bc->period_frames;
+  }
+
+  rec->off = 0;
+  rec->prev_len = 0;
+  rec->blocks = 0;
+  rec->frames = 0;
+  rec->lost = 0;
+  if (rec->flac) {
+    ret = codec_flac_header(rec->format, rec->channels, rec->rate,
+                            rec->block_frames, 0, rec->batch);
+    rec->used = (ret > 0) ? ret : 0;
+  } else {
+    wav_header(0, rec->batch);
+    rec->used = WAV_HEADER_BYTES;
+  }
+
+  if (bc->verbose) {
+    printf("Recording %s audio to %s\n", REC_SOURCE_NAME(source), path);
+  }
+
+  return 0;
+}
+
+static void rec_close(buffer_config_t *bc) {
+  uint8_t header[WAV_HEADER_BYTES];
+  int len;
+
+  rec_write(bc, true);
+
+  /* now the length is known */
+  if (rec->flac) {
+    len = codec_flac_header(rec->format, rec->channels, rec->rate,
+                            rec->block_frames, rec->frames, header);
+  } else {
+    wav_header(rec->frames * rec->frame_bytes, header);
+    len = WAV_HEADER_BYTES;
+  }
+  if ((len > 0) && (pwrite(rec->fd, header, len, 0) != len)) {
+    fprintf(stderr, "Recorder header update failed (%s)\n", strerror(errno));
+  }
+
+  fdatasync(rec->fd);
+  posix_fadvise(rec->fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(rec->fd);
+  rec->fd = -1;
+
+  if (rec->lost) {
+    fprintf(stderr, "Warning: recording %s is missing %.1f seconds\n",
+            rec->name, (double)rec->lost / rec->rate);
+  }
+  if (bc->verbose) {
+    printf("Recorded %.1f seconds to %s\n",
+           (double)rec->frames / rec->rate, rec->name);
+  }
+}
+
+/* oldest period still in the buffer.  Called with lock */
+static uint64_t oldest_seq(buffer_config_t *bc) {
+  unsigned int stable = bc->mem_num_periods - 2 - bc->write_ahead_p;
+  unsigned int keep = (bc->keep_p < stable) ? bc->keep_p : stable;
+
+  return (bc->cap_count > keep) ? bc->cap_count - keep : 0;
+}
+
+/* add a block of up to block_frames frames to the batch */
+static void rec_block(buffer_config_t *bc, const uint8_t *data,
+                      unsigned int frames) {
+  int len;
+
+  if (REC_BATCH_BYTES - rec->used < rec->period_max) {
+    rec_write(bc, false);
+  }
+
+  if (rec->flac) {
+    len = codec_flac_frame(rec->format, rec->channels, data, frames,
+                           rec->blocks, rec->batch + rec->used,
+                           REC_BATCH_BYTES - rec->used);
+    if (len < 0) {
+      fprintf(stderr, "Recorder failed to encode period (%d)\n", len);
+      return;
+    }
+  } else {
+    len = frames * rec->frame_bytes;
+    memcpy(rec->batch + rec->used, data, len);
+  }
+
+  rec->used += len;
+  rec->blocks++;
+  rec->frames += frames;
+}
+
+/* add the period with capture sequence 'seq' to the batch */
+static void rec_period(buffer_config_t *bc, uint64_t seq) {
+  rec_block(bc, ring_period_ptr(bc, seq % bc->mem_num_periods),
+            bc->period_frames);
+}
+
+/* add the played audio handed over so far in whole blocks, or all of it
+ * (the last block short) when the recording ends */
+static void rec_played(buffer_config_t *bc, bool all) {
+  uint64_t head = __atomic_load_n(&rec->played_head, __ATOMIC_ACQUIRE);
+  uint64_t lost = __atomic_exchange_n(&rec->played_lost, 0, __ATOMIC_RELAXED);
+  unsigned int fb = rec->frame_bytes;
+  unsigned int frames, pos, first;
+  uint8_t *data;
+
+  if (lost) {
+    fprintf(stderr, "Warning: recorder fell behind; %llu played frames "
+            "lost\n", (unsigned long long)lost);
+    rec->lost += lost;
+  }
+
+  while ((head - rec->played_tail >= rec->block_frames) ||
+         (all && (head > rec->played_tail))) {
+    frames = head - rec->played_tail;
+    frames = (frames < rec->block_frames) ? frames : rec->block_frames;
+    pos = rec->played_tail % rec->played_frames;
+    data = rec->played + (size_t)pos * fb;
+    if (pos + frames > rec->played_frames) {
+      first = rec->played_frames - pos;
+      memcpy(rec->wrapped, data, (size_t)first * fb);
+      memcpy(rec->wrapped + (size_t)first * fb, rec->played,
+             (size_t)(frames - first) * fb);
+      data = rec->wrapped;
+    }
+    rec_block(bc, data, frames);
+    __atomic_store_n(&rec->played_tail, rec->played_tail + frames,
+                     __ATOMIC_RELEASE);
+  }
+}
+
+static void *recorder_thread(void *data) {
+  buffer_config_t *bc = (buffer_config_t *)data;
+  uint64_t end, oldest, seq;
+  rec_source_t source, want;
+
+  /* stay out of the way of everything else */
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), REC_NICE);
+
+  pthread_mutex_lock(&bc->lock);
+  while (bc->state || (rec->source != REC_OFF)) {
+    source = rec->source;
+    want = bc->state ? rec->want : REC_OFF;
+
+    if (want != source) {
+      pthread_mutex_unlock(&bc->lock);
+      if (source == REC_DELAYED) {
+        __atomic_store_n(&played_on, false, __ATOMIC_RELEASE);
+        rec_played(bc, true);
+      }
+      if (source != REC_OFF) {
+        rec_close(bc);
+      }
+      if ((want != REC_OFF) && (rec_open(bc, want) < 0)) {
+        want = REC_OFF;
+      }
+      if (want == REC_DELAYED) {
+        /* start from what is played from now on */
+        __atomic_store_n(&rec->played_lost, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&played_on, true, __ATOMIC_RELEASE);
+        __atomic_store_n(&rec->played_tail,
+                         __atomic_load_n(&rec->played_head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+      }
+      pthread_mutex_lock(&bc->lock);
+      rec->source = rec->want = want;
+      rec->next = bc->cap_count;
+      continue;
+    }
+
+    /* played audio arrives at about the rate periods are captured */
+    if (source == REC_DELAYED) {
+      pthread_mutex_unlock(&bc->lock);
+      rec_played(bc, false);
+      pthread_mutex_lock(&bc->lock);
+      if (bc->state && (rec->want == source)) {
+        pthread_cond_wait(&bc->captured, &bc->lock);
+      }
+      continue;
+    }
+
+    end = bc->cap_count;
+    if ((source == REC_OFF) || (rec->next >= end)) {
+      pthread_cond_wait(&bc->captured, &bc->lock);
+      continue;
+    }
+
+    /* skip anything the capture pointer has already overwritten */
+    oldest = oldest_seq(bc);
+    if (rec->next < oldest) {
+      fprintf(stderr, "Warning: recorder fell behind; %llu periods lost\n",
+              (unsigned long long)(oldest - rec->next));
+      rec->lost += (oldest - rec->next) * bc->period_frames;
+      rec->next = oldest;
+    }
+    pthread_mutex_unlock(&bc->lock);
+
+    for (seq = rec->next; seq < end; seq++) {
+      rec_period(bc, seq);
+    }
+
+    pthread_mutex_lock(&bc->lock);
+    if (rec->next < oldest_seq(bc)) {
+      fprintf(stderr, "Warning: recorder fell behind; audio overwritten while "
+              "recording it\n");
+    }
+    rec->next = end;
+  }
+  pthread_mutex_unlock(&bc->lock);
+
+  return NULL;
+}
+
+/*
+ * External Interface Functions
+ */
+int recorder_init(buffer_config_t *bc, settings_t *settings) {
+  size_t played_max;
+
+  if (!settings->record_dir[0]) {
+    return 0;
+  }
+
+  rec = calloc(1, sizeof(*rec));
+  if (!rec) {
+    return -ENOMEM;
+  }
+
+  strncpy(rec->dir, settings->record_dir, MAX_PATH_LEN);
+  rec->flac = settings->record_flac;
+  rec->fd = -1;
+
+  /* played audio is handed over in playback periods; the ring is committed
+   * now so the audio thread never page faults on it */
+  rec->play_block = ((uint64_t)bc->period_frames * bc->play_rate +
+                     bc->rate / 2) / bc->rate;
+  rec->play_block = rec->play_block ? rec->play_block : 1;
+  rec->played_frames = ((uint64_t)bc->play_rate * REC_PLAYED_MS) / 1000;
+  rec->played = malloc((size_t)rec->played_frames * bc->play_frame_bytes);
+  rec->wrapped = malloc((size_t)rec->play_block * bc->play_frame_bytes);
+  if (!rec->played || !rec->wrapped) {
+    fprintf(stderr, "Could not allocate recorder memory\n");
+    free(rec->played);
+    free(rec->wrapped);
+    free(rec);
+    rec = NULL;
+    return -ENOMEM;
+  }
+  memset(rec->played, 0, (size_t)rec->played_frames * bc->play_frame_bytes);
+
+  /* an elastic buffer only keeps this much for the recorder to fall behind */
+  pthread_mutex_lock(&bc->lock);
+  if (bc->keep_extra_p < (REC_MAX_LAG_MS * 1000ULL) / bc->period_time) {
+    bc->keep_extra_p = (REC_MAX_LAG_MS * 1000ULL) / bc->period_time;
+  }
+  pthread_mutex_unlock(&bc->lock);
+
+  /* the larger of a live and a delayed block */
+  if (rec->flac) {
+    rec->period_max = codec_flac_max_bytes(bc->format, bc->channels,
+                                           bc->period_frames);
+    played_max = codec_flac_max_bytes(bc->play_format, bc->play_channels,
+                                      rec->play_block);
+  } else {
+    rec->period_max = bc->period_bytes;
+    played_max = (size_t)rec->play_block * bc->play_frame_bytes;
+  }
+  if (played_max > rec->period_max) {
+    rec->period_max = played_max;
+  }
+  if ((rec->period_max + REC_ALIGN > REC_BATCH_BYTES) ||
+      posix_memalign((void **)&rec->batch, REC_ALIGN, REC_BATCH_BYTES)) {
+    fprintf(stderr, "Could not allocate recorder memory\n");
+    free(rec->played);
+    free(rec->wrapped);
+    free(rec);
+    rec = NULL;
+    return -ENOMEM;
+  }
+
+  if (pthread_create(&rec->thread, NULL, recorder_thread, bc)) {
+    fprintf(stderr, "Could not create recorder thread\n");
+    free(rec->batch);
+    free(rec->played);
+    free(rec->wrapped);
+    free(rec);
+    rec = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* finishes any recording in progress.  Called once the audio thread has
+ * stopped handing over played audio */
+void recorder_cleanup(buffer_config_t *bc) {
+  if (!rec) {
+    return;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  pthread_cond_broadcast(&bc->captured);
+  pthread_mutex_unlock(&bc->lock);
+  pthread_join(rec->thread, NULL);
+
+  free(rec->batch);
+  free(rec->played);
+  free(rec->wrapped);
+  free(rec);
+  rec = NULL;
+}
+
+int recorder_start(buffer_config_t *bc, rec_source_t source) {
+  snd_pcm_format_t format;
+
+  if (!rec) {
+    fprintf(stderr, "Recording is not enabled (use --record)\n");
+    return -ENODEV;
+  }
+
+  /* a live recording reads the delay buffer from another thread, which the
+   * spill read-ahead and the compressed ring's decode cache don't allow */
+  if ((source == REC_LIVE) && (bc->spill || bc->zring)) {
+    fprintf(stderr, "Live recording needs an uncompressed RAM buffer\n");
+    return -EINVAL;
+  }
+
+  format = (source == REC_DELAYED) ? bc->play_format : bc->format;
+  if (rec->flac && (format == SND_PCM_FORMAT_S32_LE)) {
+    fprintf(stderr, "FLAC recording needs 16 or 24 bit audio\n");
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  if (rec->want != REC_OFF) {
+    pthread_mutex_unlock(&bc->lock);
+    return -EBUSY;
+  }
+  rec->want = source;
+  pthread_cond_broadcast(&bc->captured);
+  pthread_mutex_unlock(&bc->lock);
+
+  return 0;
+}
+
+void recorder_stop(buffer_config_t *bc) {
+  if (!rec) {
+    return;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  rec->want = REC_OFF;
+  pthread_cond_broadcast(&bc->captured);
+  pthread_mutex_unlock(&bc->lock);
+}
+
+/* source being recorded and name of the file */
+rec_source_t recorder_status(buffer_config_t *bc, char *name, size_t len) {
+  rec_source_t source;
+
+  if (!rec) {
+    return REC_OFF;
+  }
+
+  pthread_mutex_lock(&bc->lock);
+  source = rec->source;
+  snprintf(name, len, "%s", rec->name);
+  pthread_mutex_unlock(&bc->lock);
+
+  return source;
+}
+
+/* hand the audio passed to ALSA to a delayed recording.  Audio thread; never
+ * blocks */
+void recorder_played(buffer_config_t *bc, const uint8_t *data,
+                     unsigned int frames) {
+  unsigned int fb = bc->play_frame_bytes;
+  unsigned int pos, first;
+  uint64_t head, tail;
+
+  if (!__atomic_load_n(&played_on, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  head = rec->played_head;
+  tail = __atomic_load_n(&rec->played_tail, __ATOMIC_ACQUIRE);
+  if (rec->played_frames - (head - tail) < frames) {
+    __atomic_fetch_add(&rec->played_lost, frames, __ATOMIC_RELAXED);
+    return;
+  }
+
+  pos = head % rec->played_frames;
+  first = rec->played_frames - pos;
+  first = (frames < first) ? frames : first;
+  memcpy(rec->played + (size_t)pos * fb, data, (size_t)first * fb);
+  memcpy(rec->played, data + (size_t)first * fb, (size_t)(frames - first) * fb);
+  __atomic_store_n(&rec->played_head, head + frames, __ATOMIC_RELEASE);
+}
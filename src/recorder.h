@@ -0,0 +1,32 @@
+#ifndef __RECORDER_H
+#define __RECORDER_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+#define REC_BATCH_BYTES  (1024 * 1024)  /* size of each file write */
+#define REC_ALIGN        4096           /* file write alignment */
+#define REC_NICE         10             /* recorder thread priority */
+#define REC_MAX_LAG_MS   10000          /* lag kept by an elastic buffer */
+#define REC_PLAYED_MS    2000           /* played audio waiting to be written */
+#define MAX_REC_NAME     48
+
+typedef enum rec_source {
+  REC_OFF = 0,
+  REC_LIVE,      /* audio as it is captured */
+  REC_DELAYED,   /* audio as it is played (after the speed changes,
+                    seeks, quiet drops/repeats, dsp and conversion) */
+} rec_source_t;
+
+#define REC_SOURCE_NAME(x) \
+  (x == REC_LIVE)?"live": \
+  (x == REC_DELAYED)?"delayed":"off"
+
+int recorder_init(buffer_config_t *bc, settings_t *settings);
+void recorder_cleanup(buffer_config_t *bc);
+int recorder_start(buffer_config_t *bc, rec_source_t source);
+void recorder_stop(buffer_config_t *bc);
+rec_source_t recorder_status(buffer_config_t *bc, char *name, size_t len);
+void recorder_played(buffer_config_t *bc, const uint8_t *data,
+                     unsigned int frames);
+#endif
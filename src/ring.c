@@ -0,0 +1,954 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "ring.h"
+#include "codec.h"
+#include "tap.h"
+
+/*
+ * Delay buffer storage
+ *
+ * By default the whole delay buffer is in RAM.  When a spill file is
+ * configured, the buffer is a ring of chunks in the file and only a window
+ * of the most recently captured chunks (the hot window) plus a few read-ahead
+ * chunks are kept in RAM:
+ *
+ *   - The capture pointer always writes into the hot window.  Each chunk is
+ *     queued for a single large, aligned write to the file as soon as it is
+ *     complete.
+ *   - When the delay is shorter than the hot window, the play pointer also
+ *     reads from the hot window.  Otherwise the spill I/O thread reads the
+ *     chunks just ahead of the play pointer back from the file.
+ *
+ * The audio thread never touches the file, so a slow disk shows up as
+ * missing (silent) periods rather than capture overruns.
+ *
+ * The RAM buffer is only reserved address space.  Pages are committed as
+ * the capture pointer first writes them and released again (in chunks)
+ * once nothing is left in them that is still needed: the periods between
+ * the play and capture pointers, the delay setting and whatever other
+ * readers (network output, recorder) asked to keep.  Resident memory then
+ * follows the delay rather than --memory, which is only the ceiling.
+ *
+ * The RAM buffer is a memfd mapped twice back to back (when its size can
+ * be a whole number of both periods and pages), so any run of up to the
+ * whole ring is contiguous in memory: capture and playback read and write
+ * several periods at once without splitting at the end of the ring.
+ *
+ * With --tap the RAM buffer is shared with local readers (tap.c) and stays
+ * fully committed, since readers may still be following released periods.
+ *
+ * When compression is enabled, each captured period is losslessly encoded
+ * (codec.c) into a ring of variable size blocks in RAM with an index of
+ * where each period's block is.  Periods are decoded as the play pointer
+ * reaches them.  If the audio doesn't compress as well as expected, the
+ * oldest blocks are overwritten and play back as silence.
+ */
+
+typedef struct spill {
+  int fd;
+  unsigned int chunk_periods;   /* periods per chunk */
+  size_t chunk_bytes;           /* bytes of audio in a chunk */
+  size_t chunk_stride;          /* chunk size in the file (aligned) */
+  unsigned int num_chunks;      /* chunks in the file */
+  unsigned int hot_chunks;      /* chunks in the RAM hot window */
+  uint8_t *hot;                 /* hot window (hot_chunks * chunk_bytes) */
+
+  /* read-ahead chunks */
+  uint8_t *ra;                  /* SPILL_READAHEAD * chunk_bytes */
+  int ra_chunk[SPILL_READAHEAD];    /* chunk loaded in slot (-1 = none) */
+  uint64_t ra_seq[SPILL_READAHEAD]; /* capture sequence of loaded chunk */
+  bool ra_valid[SPILL_READAHEAD];   /* slot contents can be played */
+
+  /* protected by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  uint64_t done_seq;            /* number of chunks captured */
+  uint64_t flush_seq;           /* number of chunks written to file */
+  unsigned int cap_chunk;       /* chunk the capture pointer is in */
+  unsigned int play_chunk;      /* chunk the play pointer is in */
+
+  pthread_t thread;
+  bool running;
+} spill_t;
+
+typedef struct zring {
+  uint8_t *data;                /* compressed block ring */
+  size_t size;
+  uint64_t head;                /* stream position of next block */
+  uint64_t *pos;                /* per period: stream position of block */
+  uint32_t *len;                /* per period: block length (0 = empty) */
+  uint8_t *staging;             /* period being captured */
+  uint8_t *block;               /* encode scratch */
+  size_t block_max;
+
+  /* decoded periods */
+  uint8_t *dec;
+  unsigned int dec_period[ZRING_CACHE];
+  uint64_t dec_pos[ZRING_CACHE];    /* UINT64_MAX = empty */
+  unsigned int dec_next;
+
+  /* codec statistics */
+  uint64_t raw_bytes;
+  uint64_t enc_bytes;
+  uint64_t enc_ns;
+  uint64_t dec_ns;
+  unsigned int enc_n;
+  unsigned int dec_n;
+  bool overrun;
+} zring_t;
+
+typedef struct elastic {
+  unsigned int chunk_periods;   /* periods per chunk */
+  unsigned int num_chunks;
+  bool *resident;               /* per chunk: may hold committed pages */
+  bool *live;                   /* per chunk: holds needed periods */
+  unsigned int cap_chunk;       /* chunk the capture pointer is in */
+  unsigned int play_chunk;      /* chunk the play pointer is in */
+} elastic_t;
+
+/* chunks the capture pointer has moved on since chunk 'c' was captured */
+static unsigned int chunk_age(spill_t *sp, unsigned int c) {
+  return (sp->cap_chunk + sp->num_chunks - c) % sp->num_chunks;
+}
+
+static bool chunk_is_hot(spill_t *sp, unsigned int c) {
+  return chunk_age(sp, c) < sp->hot_chunks;
+}
+
+/* capture sequence number of the data currently held for chunk 'c' */
+static uint64_t chunk_seq(spill_t *sp, unsigned int c) {
+  return sp->done_seq - chunk_age(sp, c);
+}
+
+static uint8_t *hot_chunk_ptr(spill_t *sp, unsigned int c) {
+  return sp->hot + (c % sp->hot_chunks) * sp->chunk_bytes;
+}
+
+static uint8_t *ra_chunk_ptr(spill_t *sp, unsigned int slot) {
+  return sp->ra + slot * sp->chunk_bytes;
+}
+
+/* write out all captured chunks which haven't been flushed yet */
+static void spill_flush(buffer_config_t *bc, spill_t *sp) {
+  uint64_t seq;
+  unsigned int c;
+  off_t off;
+  ssize_t ret;
+
+  pthread_mutex_lock(&sp->lock);
+  while (sp->flush_seq < sp->done_seq) {
+    seq = sp->flush_seq;
+    c = seq % sp->num_chunks;
+    if (sp->done_seq - seq >= sp->hot_chunks) {
+      fprintf(stderr, "Warning: spill writes fell behind; chunk %d lost\n", c);
+      sp->flush_seq++;
+      continue;
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    off = (off_t)c * sp->chunk_stride;
+    ret = pwrite(sp->fd, hot_chunk_ptr(sp, c), sp->chunk_bytes, off);
+    if (ret != sp->chunk_bytes) {
+      fprintf(stderr, "Spill write failed (%s)\n",
+              (ret < 0) ? strerror(errno) : "short write");
+    }
+
+    /* start writeback now and drop the previous chunk from the page cache
+     * so dirty pages don't pile up in the Pi's small memory */
+    sync_file_range(sp->fd, off, sp->chunk_bytes, SYNC_FILE_RANGE_WRITE);
+    if (c) {
+      posix_fadvise(sp->fd, off - sp->chunk_stride, sp->chunk_stride,
+                    POSIX_FADV_DONTNEED);
+    }
+
+    pthread_mutex_lock(&sp->lock);
+    sp->flush_seq = seq + 1;
+  }
+  pthread_mutex_unlock(&sp->lock);
+}
+
+/* load chunks just ahead of the play pointer which are no longer hot */
+static void spill_readahead(buffer_config_t *bc, spill_t *sp) {
+  unsigned int i, slot, c, age;
+  bool wanted[SPILL_READAHEAD];
+  ssize_t ret;
+
+  pthread_mutex_lock(&sp->lock);
+  for (i = 0; i < SPILL_READAHEAD; i++) {
+    c = (sp->play_chunk + i) % sp->num_chunks;
+    age = chunk_age(sp, c);
+
+    /* chunks about to leave the hot window need loading too */
+    if ((age + 1 < sp->hot_chunks) || (age == 0) || (age > sp->done_seq)) {
+      continue;
+    }
+
+    /* only chunks which made it to the file can be read back */
+    if (chunk_seq(sp, c) >= sp->flush_seq) {
+      continue;
+    }
+
+    for (slot = 0; slot < SPILL_READAHEAD; slot++) {
+      if ((sp->ra_chunk[slot] == c) && (sp->ra_seq[slot] == chunk_seq(sp, c))) {
+        break;
+      }
+    }
+    if (slot < SPILL_READAHEAD) {
+      continue;
+    }
+
+    /* evict a slot which isn't needed around the play pointer */
+    for (slot = 0; slot < SPILL_READAHEAD; slot++) {
+      wanted[slot] = (sp->ra_chunk[slot] >= 0) &&
+        (((sp->ra_chunk[slot] + sp->num_chunks - sp->play_chunk + 1) %
+          sp->num_chunks) <= SPILL_READAHEAD);
+    }
+    for (slot = 0; slot < SPILL_READAHEAD && wanted[slot]; slot++);
+    if (slot == SPILL_READAHEAD) {
+      break;
+    }
+
+    sp->ra_chunk[slot] = c;
+    sp->ra_seq[slot] = chunk_seq(sp, c);
+    sp->ra_valid[slot] = false;
+    pthread_mutex_unlock(&sp->lock);
+
+    ret = pread(sp->fd, ra_chunk_ptr(sp, slot), sp->chunk_bytes,
+                (off_t)c * sp->chunk_stride);
+    posix_fadvise(sp->fd, (off_t)c * sp->chunk_stride, sp->chunk_stride,
+                  POSIX_FADV_DONTNEED);
+
+    pthread_mutex_lock(&sp->lock);
+    if (ret != sp->chunk_bytes) {
+      fprintf(stderr, "Spill read failed (%s)\n",
+              (ret < 0) ? strerror(errno) : "short read");
+      sp->ra_chunk[slot] = -1;
+    } else if (sp->ra_chunk[slot] == c) {
+      sp->ra_valid[slot] = true;
+    }
+  }
+  pthread_mutex_unlock(&sp->lock);
+}
+
+static void *spill_io_thread(void *data) {
+  buffer_config_t *bc = (buffer_config_t *)data;
+  spill_t *sp = bc->spill;
+
+  while (sp->running) {
+    spill_flush(bc, sp);
+    spill_readahead(bc, sp);
+
+    pthread_mutex_lock(&sp->lock);
+    if (sp->running && (sp->flush_seq == sp->done_seq)) {
+      pthread_cond_wait(&sp->wake, &sp->lock);
+    }
+    pthread_mutex_unlock(&sp->lock);
+  }
+
+  return NULL;
+}
+
+static int spill_init(buffer_config_t *bc, settings_t *settings) {
+  spill_t *sp;
+  int err;
+
+  sp = calloc(1, sizeof(*sp));
+  if (!sp) {
+    return -ENOMEM;
+  }
+
+  sp->chunk_periods = SPILL_CHUNK_BYTES / bc->period_bytes;
+  if (!sp->chunk_periods) {
+    sp->chunk_periods = 1;
+  }
+  sp->chunk_bytes = sp->chunk_periods * bc->period_bytes;
+  sp->chunk_stride = ((sp->chunk_bytes + SPILL_ALIGN - 1) / SPILL_ALIGN) *
+                     SPILL_ALIGN;
+  sp->num_chunks = settings->spill_size / sp->chunk_stride;
+
+  /* the RAM budget is split between the hot window and read-ahead */
+  sp->hot_chunks = settings->memory / sp->chunk_bytes;
+  if (sp->hot_chunks <= SPILL_READAHEAD + SPILL_MIN_HOT) {
+    sp->hot_chunks = SPILL_MIN_HOT;
+  } else {
+    sp->hot_chunks -= SPILL_READAHEAD;
+  }
+
+  /* hot chunks are kept in slot (chunk % hot_chunks), which is only unique
+   * across the wrap of the file when it holds a whole number of windows */
+  sp->num_chunks -= sp->num_chunks % sp->hot_chunks;
+
+  if (sp->num_chunks <= sp->hot_chunks) {
+    fprintf(stderr, "Spill size must be larger than the memory buffer\n");
+    free(sp);
+    return -EINVAL;
+  }
+
+  sp->fd = open(settings->spill_file, O_RDWR | O_CREAT, 0600);
+  if (sp->fd < 0) {
+    err = -errno;
+    fprintf(stderr, "cannot open spill file %s (%s)\n",
+            settings->spill_file, strerror(errno));
+    free(sp);
+    return err;
+  }
+
+  /* reserve the whole file up front so it's laid out sequentially */
+  if ((err = posix_fallocate(sp->fd, 0,
+                             (off_t)sp->num_chunks * sp->chunk_stride))) {
+    fprintf(stderr, "cannot allocate spill file %s (%s)\n",
+            settings->spill_file, strerror(err));
+    close(sp->fd);
+    free(sp);
+    return -err;
+  }
+  posix_fadvise(sp->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  sp->hot = malloc(sp->hot_chunks * sp->chunk_bytes);
+  sp->ra = malloc(SPILL_READAHEAD * sp->chunk_bytes);
+  if (!sp->hot || !sp->ra) {
+    fprintf(stderr, "Could allocate spill buffer memory\n");
+    close(sp->fd);
+    free(sp->hot);
+    free(sp->ra);
+    free(sp);
+    return -ENOMEM;
+  }
+  memset(sp->ra_chunk, -1, sizeof(sp->ra_chunk));
+
+  pthread_mutex_init(&sp->lock, NULL);
+  pthread_cond_init(&sp->wake, NULL);
+  sp->running = true;
+  bc->spill = sp;
+  bc->mem_num_periods = sp->num_chunks * sp->chunk_periods;
+
+  if (pthread_create(&sp->thread, NULL, spill_io_thread, bc)) {
+    fprintf(stderr, "Could not create spill I/O thread\n");
+    ring_cleanup(bc);
+    return -1;
+  }
+
+  if (settings->verbose) {
+    printf("Spill:\n");
+    printf("  File:         %s\n", settings->spill_file);
+    printf("  Size:         %llu MB\n",
+           (unsigned long long)settings->spill_size / 1024 / 1024);
+    printf("  Chunk:        %d periods (%ld bytes)\n", sp->chunk_periods,
+           (long)sp->chunk_bytes);
+    printf("  Hot Window:   %d chunks\n", sp->hot_chunks);
+  }
+
+  return 0;
+}
+
+static uint64_t ns_since(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+         (now.tv_nsec - start->tv_nsec);
+}
+
+static void zring_free(zring_t *zr) {
+  free(zr->data);
+  free(zr->pos);
+  free(zr->len);
+  free(zr->staging);
+  free(zr->block);
+  free(zr->dec);
+  free(zr);
+}
+
+static int zring_init(buffer_config_t *bc, settings_t *settings) {
+  zring_t *zr;
+  unsigned int i;
+
+  zr = calloc(1, sizeof(*zr));
+  if (!zr) {
+    return -ENOMEM;
+  }
+
+  bc->mem_num_periods = (settings->memory * ZRING_RATIO) / bc->period_bytes;
+  zr->size = settings->memory;
+  zr->block_max = codec_max_bytes(bc->format, bc->channels, bc->period_frames);
+  zr->data = malloc(zr->size);
+  zr->pos = calloc(bc->mem_num_periods, sizeof(*zr->pos));
+  zr->len = calloc(bc->mem_num_periods, sizeof(*zr->len));
+  zr->staging = malloc(bc->period_bytes);
+  zr->block = malloc(zr->block_max);
+  zr->dec = malloc(ZRING_CACHE * bc->period_bytes);
+  if (!zr->data || !zr->pos || !zr->len || !zr->staging || !zr->block ||
+      !zr->dec) {
+    fprintf(stderr, "Could allocate compressed buffer memory\n");
+    zring_free(zr);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < ZRING_CACHE; i++) {
+    zr->dec_pos[i] = UINT64_MAX;
+  }
+  bc->zring = zr;
+
+  if (settings->verbose) {
+    printf("Compressed buffer:\n");
+    printf("  Index:        %d periods (assumes %d:1 compression)\n",
+           bc->mem_num_periods, ZRING_RATIO);
+  }
+
+  return 0;
+}
+
+/* encode the period just captured into the block ring */
+static void zring_captured(buffer_config_t *bc, zring_t *zr) {
+  unsigned int period = (bc->cap ? bc->cap : bc->mem_num_periods) - 1;
+  struct timespec start;
+  size_t off, first;
+  int len;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  len = codec_encode(bc->format, bc->channels, zr->staging, bc->period_frames,
+                     zr->block, zr->block_max);
+  zr->enc_ns += ns_since(&start);
+  zr->enc_n++;
+  if (len <= 0) {
+    fprintf(stderr, "Warning: failed to encode period %d (%d)\n", period, len);
+    zr->len[period] = 0;
+    return;
+  }
+
+  /* copy into the ring, wrapping around the end if needed */
+  off = zr->head % zr->size;
+  first = (off + len > zr->size) ? zr->size - off : len;
+  memcpy(zr->data + off, zr->block, first);
+  memcpy(zr->data, zr->block + first, len - first);
+  zr->pos[period] = zr->head;
+  zr->len[period] = len;
+  zr->head += len;
+  zr->raw_bytes += bc->period_bytes;
+  zr->enc_bytes += len;
+
+  /* warn (once per occurrence) when unplayed audio is being overwritten */
+  if (zr->len[bc->play] && (zr->head - zr->pos[bc->play] > zr->size)) {
+    if (!zr->overrun) {
+      fprintf(stderr, "Warning: audio doesn't compress enough for this "
+              "delay; oldest audio lost\n");
+    }
+    zr->overrun = true;
+  } else {
+    zr->overrun = false;
+  }
+
+  if (bc->verbose && (zr->enc_n == ZRING_STATS)) {
+    printf("Codec: ratio %.2f  encode %.1f us/period  decode %.1f us/period  "
+           "(period %.1f us)\n",
+           (double)zr->raw_bytes / zr->enc_bytes,
+           zr->enc_ns / 1000.0 / zr->enc_n,
+           zr->dec_n ? zr->dec_ns / 1000.0 / zr->dec_n : 0.0,
+           (double)bc->period_time);
+    zr->enc_ns = zr->dec_ns = 0;
+    zr->enc_n = zr->dec_n = 0;
+  }
+}
+
+static uint8_t *zring_period_ptr(buffer_config_t *bc, zring_t *zr,
+                                 unsigned int period) {
+  struct timespec start;
+  unsigned int slot;
+  size_t off, first;
+  const uint8_t *block;
+  uint8_t *ptr;
+  int err;
+
+  if (period == bc->cap) {
+    return zr->staging;
+  }
+
+  /* empty or already overwritten */
+  if (!zr->len[period] || (zr->head - zr->pos[period] > zr->size)) {
+    return NULL;
+  }
+
+  for (slot = 0; slot < ZRING_CACHE; slot++) {
+    if ((zr->dec_period[slot] == period) &&
+        (zr->dec_pos[slot] == zr->pos[period])) {
+      return zr->dec + slot * bc->period_bytes;
+    }
+  }
+
+  slot = zr->dec_next;
+  zr->dec_next = (zr->dec_next + 1) % ZRING_CACHE;
+  ptr = zr->dec + slot * bc->period_bytes;
+
+  /* blocks which wrap around the end of the ring are reassembled first */
+  off = zr->pos[period] % zr->size;
+  if (off + zr->len[period] > zr->size) {
+    first = zr->size - off;
+    memcpy(zr->block, zr->data + off, first);
+    memcpy(zr->block + first, zr->data, zr->len[period] - first);
+    block = zr->block;
+  } else {
+    block = zr->data + off;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  err = codec_decode(bc->format, bc->channels, block, zr->len[period],
+                     ptr, bc->period_frames);
+  zr->dec_ns += ns_since(&start);
+  zr->dec_n++;
+  if (err) {
+    fprintf(stderr, "Warning: failed to decode period %d (%d)\n", period, err);
+    zr->dec_pos[slot] = UINT64_MAX;
+    return NULL;
+  }
+
+  zr->dec_period[slot] = period;
+  zr->dec_pos[slot] = zr->pos[period];
+  return ptr;
+}
+
+
+/*
+ * Double mapped ("magic") RAM buffer
+ */
+static size_t gcd(size_t a, size_t b) {
+  while (b) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* periods in a ring of at most 'bytes' whose size is a page multiple */
+static unsigned int magic_periods(buffer_config_t *bc, size_t bytes) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t unit = page / gcd(bc->period_bytes, page);  /* periods per unit */
+
+  return ((bytes / bc->period_bytes) / unit) * unit;
+}
+
+static int magic_init(buffer_config_t *bc) {
+  uint8_t *base;
+
+  bc->buffer_fd = memfd_create("nojoebuck-ring", MFD_CLOEXEC);
+  if (bc->buffer_fd < 0) {
+    return -errno;
+  }
+  if (ftruncate(bc->buffer_fd, bc->buffer_bytes) ||
+      !(base = ring_map_twice(bc->buffer_fd, 0, bc->buffer_bytes))) {
+    close(bc->buffer_fd);
+    return -ENOMEM;
+  }
+
+  bc->buffer = base;
+  bc->magic = true;
+  return 0;
+}
+
+
+/*
+ * Elastic RAM buffer
+ */
+static void elastic_free(elastic_t *el) {
+  free(el->resident);
+  free(el->live);
+  free(el);
+}
+
+static int elastic_init(buffer_config_t *bc) {
+  elastic_t *el;
+
+  el = calloc(1, sizeof(*el));
+  if (!el) {
+    return -ENOMEM;
+  }
+
+  el->chunk_periods = ELASTIC_CHUNK_BYTES / bc->period_bytes;
+  if (!el->chunk_periods) {
+    el->chunk_periods = 1;
+  }
+  el->num_chunks = (bc->mem_num_periods + el->chunk_periods - 1) /
+                   el->chunk_periods;
+  if (el->num_chunks < ELASTIC_MIN_CHUNKS) {
+    free(el);
+    return 0;
+  }
+
+  el->resident = calloc(el->num_chunks, sizeof(*el->resident));
+  el->live = calloc(el->num_chunks, sizeof(*el->live));
+  if (!el->resident || !el->live) {
+    elastic_free(el);
+    return -ENOMEM;
+  }
+  el->resident[0] = true;
+  bc->elastic = el;
+
+  return 0;
+}
+
+/* release a chunk's pages.  Edge pages are shared with the neighbouring
+ * chunks so they are only released once the neighbour is released too */
+static void elastic_release(buffer_config_t *bc, elastic_t *el,
+                            unsigned int c) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t base = (uintptr_t)bc->buffer;
+  uintptr_t start = base + (size_t)c * el->chunk_periods * bc->period_bytes;
+  uintptr_t end = start + (size_t)el->chunk_periods * bc->period_bytes;
+  bool prev_free = !c || !el->resident[c - 1];
+  bool next_free = (c == el->num_chunks - 1) || !el->resident[c + 1];
+
+  end = (end < base + bc->buffer_bytes) ? end : base + bc->buffer_bytes;
+  start = prev_free ? (start & ~(page - 1)) : ((start + page - 1) & ~(page - 1));
+  end = next_free ? ((end + page - 1) & ~(page - 1)) : (end & ~(page - 1));
+  if ((end > start) && bc->magic) {
+    fallocate(bc->buffer_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              start - base, end - start);
+  } else if (end > start) {
+    madvise((void *)start, end - start, MADV_DONTNEED);
+  }
+  el->resident[c] = false;
+}
+
+/*
+ * Release chunks which hold nothing that is still needed.  Runs in the
+ * audio thread each time the capture or play pointer enters a new chunk.
+ */
+static void elastic_update(buffer_config_t *bc, elastic_t *el) {
+  unsigned int n = bc->mem_num_periods;
+  unsigned int buffered = (bc->cap + n - bc->play) % n;
+  unsigned int keep, ahead, oldest, c, first, last;
+  bool *live = el->live;
+
+  /* keep the previous play period too (silence aware catch-up uses it) */
+  keep = buffered + 1;
+  if (bc->target_delta_p + bc->keep_extra_p > keep) {
+    keep = bc->target_delta_p + bc->keep_extra_p;
+  }
+  keep = (keep < n - 1) ? keep : n - 1;
+  bc->keep_p = keep;
+  oldest = (bc->cap + n - keep) % n;
+
+  /* capture may already have written up to a span beyond the pointer */
+  ahead = keep + RING_MAX_SPAN;
+  ahead = (ahead < n - 1) ? ahead : n - 1;
+
+  /* mark the chunks in use first so shared edge pages are kept */
+  for (c = 0; c < el->num_chunks; c++) {
+    /* distances of the chunk's first and last period from 'oldest' */
+    first = (c * el->chunk_periods + n - oldest) % n;
+    last = (((c + 1) * el->chunk_periods < n) ?
+            (c + 1) * el->chunk_periods - 1 : n - 1);
+    last = (last + n - oldest) % n;
+    live[c] = (first <= ahead) || (last < first);
+    if (live[c]) {
+      el->resident[c] = true;
+    }
+  }
+
+  for (c = 0; c < el->num_chunks; c++) {
+    if (!live[c] && el->resident[c]) {
+      elastic_release(bc, el, c);
+    }
+  }
+}
+
+/*
+ * External Interface Functions
+ */
+int ring_init(buffer_config_t *bc, settings_t *settings) {
+
+  if (settings->spill_file[0] && settings->compress) {
+    fprintf(stderr, "Spill file and compression can't be used together\n");
+    return -EINVAL;
+  }
+
+  if (settings->tap[0] && (settings->spill_file[0] || settings->compress)) {
+    fprintf(stderr, "The tap can't be used with a spill file or compression\n");
+    return -EINVAL;
+  }
+
+  bc->write_ahead_p = 0;
+  if (settings->spill_file[0]) {
+    return spill_init(bc, settings);
+  }
+
+  if (settings->compress) {
+    return zring_init(bc, settings);
+  }
+
+  /* a whole number of periods and pages allows the buffer to be mapped
+   * twice (see ring_map_twice()) */
+  bc->mem_num_periods = magic_periods(bc, settings->memory);
+  if (bc->mem_num_periods) {
+    bc->buffer_bytes = (size_t)bc->mem_num_periods * bc->period_bytes;
+  } else {
+    bc->mem_num_periods = settings->memory / bc->period_bytes;
+    bc->buffer_bytes = settings->memory;
+  }
+
+  /* capture reads up to RING_MAX_SPAN periods straight into the ring
+   * before the capture pointer moves past them */
+  bc->write_ahead_p = RING_MAX_SPAN - 1;
+
+  if (settings->tap[0]) {
+    if (tap_init(bc, settings) < 0) {
+      return -ENOMEM;
+    }
+  } else if ((bc->buffer_bytes % sysconf(_SC_PAGESIZE)) ||
+             (magic_init(bc) < 0)) {
+    /* reserve address space only; pages are committed as they are used */
+    bc->buffer = mmap(NULL, bc->buffer_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (bc->buffer == MAP_FAILED) {
+      bc->buffer = NULL;
+      fprintf(stderr, "Could allocate buffer memory\n");
+      return -ENOMEM;
+    }
+  }
+  bc->keep_p = bc->mem_num_periods - 2;
+
+  if (!bc->tap && (elastic_init(bc) < 0)) {
+    fprintf(stderr, "Could allocate buffer memory\n");
+    ring_cleanup(bc);
+    return -ENOMEM;
+  }
+
+  if (settings->verbose && bc->elastic) {
+    printf("Elastic buffer:\n");
+    printf("  Chunk:        %d periods\n", bc->elastic->chunk_periods);
+  }
+  if (settings->verbose) {
+    printf("  Contiguous:   %s\n", bc->magic ? "yes (double mapped)" : "no");
+  }
+
+  return 0;
+}
+
+void ring_cleanup(buffer_config_t *bc) {
+  spill_t *sp = bc->spill;
+
+  if (sp) {
+    pthread_mutex_lock(&sp->lock);
+    sp->running = false;
+    pthread_cond_signal(&sp->wake);
+    pthread_mutex_unlock(&sp->lock);
+    if (sp->thread) {
+      pthread_join(sp->thread, NULL);
+    }
+    close(sp->fd);
+    free(sp->hot);
+    free(sp->ra);
+    free(sp);
+    bc->spill = NULL;
+  }
+
+  if (bc->zring) {
+    zring_free(bc->zring);
+    bc->zring = NULL;
+  }
+
+  if (bc->elastic) {
+    elastic_free(bc->elastic);
+    bc->elastic = NULL;
+  }
+
+  tap_cleanup(bc);
+  if (bc->buffer) {
+    munmap(bc->buffer, bc->magic ? 2 * bc->buffer_bytes : bc->buffer_bytes);
+    bc->buffer = NULL;
+  }
+  if (bc->magic) {
+    close(bc->buffer_fd);
+    bc->magic = false;
+  }
+}
+
+/*
+ * Address of a period in the buffer.  In spill mode this returns NULL if
+ * the period isn't in RAM (read-ahead didn't keep up).  In compressed mode
+ * the period is decoded and the pointer is only valid until a few more
+ * periods have been requested.
+ */
+uint8_t *ring_period_ptr(buffer_config_t *bc, unsigned int period) {
+  spill_t *sp = bc->spill;
+  unsigned int c, slot;
+  uint8_t *ptr = NULL;
+
+  if (bc->zring) {
+    return zring_period_ptr(bc, bc->zring, period);
+  }
+
+  if (!sp) {
+    return bc->buffer + ((size_t)period * bc->period_bytes);
+  }
+
+  c = period / sp->chunk_periods;
+  pthread_mutex_lock(&sp->lock);
+  if (chunk_is_hot(sp, c)) {
+    ptr = hot_chunk_ptr(sp, c);
+  } else {
+    for (slot = 0; slot < SPILL_READAHEAD; slot++) {
+      if ((sp->ra_chunk[slot] == c) && sp->ra_valid[slot] &&
+          (sp->ra_seq[slot] == chunk_seq(sp, c))) {
+        ptr = ra_chunk_ptr(sp, slot);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&sp->lock);
+
+  if (ptr) {
+    ptr += (period % sp->chunk_periods) * bc->period_bytes;
+  }
+  return ptr;
+}
+
+/*
+ * Address of 'count' periods starting at 'period' when they are contiguous
+ * in memory (always for the double mapped buffer), otherwise NULL
+ */
+uint8_t *ring_span_ptr(buffer_config_t *bc, unsigned int period,
+                       unsigned int count) {
+  if (count == 1) {
+    return ring_period_ptr(bc, period);
+  }
+  if (bc->spill || bc->zring || !bc->buffer ||
+      (!bc->magic && (period + count > bc->mem_num_periods)) ||
+      (count > bc->mem_num_periods)) {
+    return NULL;
+  }
+  return bc->buffer + ((size_t)period * bc->period_bytes);
+}
+
+/*
+ * Map 'head' + 'bytes' of fd followed by its last 'bytes' again, so the
+ * buffer at base + head can be used across its end.  Both must be page
+ * multiples.  Returns the base (unmap head + 2 * bytes) or NULL.
+ */
+uint8_t *ring_map_twice(int fd, size_t head, size_t bytes) {
+  uint8_t *base;
+
+  base = mmap(NULL, head + 2 * bytes, PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+
+  if ((mmap(base, head + bytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) ||
+      (mmap(base + head + bytes, bytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, head) == MAP_FAILED)) {
+    munmap(base, head + 2 * bytes);
+    return NULL;
+  }
+
+  return base;
+}
+
+/* called by the audio thread after the capture pointer advances */
+void ring_captured(buffer_config_t *bc) {
+  spill_t *sp = bc->spill;
+  unsigned int c;
+
+  if (bc->zring) {
+    zring_captured(bc, bc->zring);
+    return;
+  }
+
+  tap_captured(bc);
+  if (bc->elastic) {
+    c = bc->cap / bc->elastic->chunk_periods;
+    if (c != bc->elastic->cap_chunk) {
+      bc->elastic->cap_chunk = c;
+      elastic_update(bc, bc->elastic);
+    }
+    return;
+  }
+
+  if (!sp) {
+    return;
+  }
+
+  c = bc->cap / sp->chunk_periods;
+  pthread_mutex_lock(&sp->lock);
+  if (c != sp->cap_chunk) {
+    sp->cap_chunk = c;
+    sp->done_seq++;
+    pthread_cond_signal(&sp->wake);
+  }
+  pthread_mutex_unlock(&sp->lock);
+}
+
+/* called by the audio thread after the play pointer moves */
+void ring_played(buffer_config_t *bc) {
+  spill_t *sp = bc->spill;
+  unsigned int c;
+
+  tap_played(bc);
+  if (bc->elastic) {
+    c = bc->play / bc->elastic->chunk_periods;
+    if (c != bc->elastic->play_chunk) {
+      bc->elastic->play_chunk = c;
+      elastic_update(bc, bc->elastic);
+    }
+    return;
+  }
+
+  if (!sp) {
+    return;
+  }
+
+  c = bc->play / sp->chunk_periods;
+  pthread_mutex_lock(&sp->lock);
+  if (c != sp->play_chunk) {
+    sp->play_chunk = c;
+    pthread_cond_signal(&sp->wake);
+  }
+  pthread_mutex_unlock(&sp->lock);
+}
+
+/* RAM held by the delay buffer (pages actually resident for the RAM ring) */
+uint64_t ring_resident_bytes(buffer_config_t *bc) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t pages, i;
+  uint64_t bytes = 0;
+  unsigned char *vec;
+
+  if (bc->spill) {
+    return (uint64_t)(bc->spill->hot_chunks + SPILL_READAHEAD) *
+           bc->spill->chunk_bytes;
+  }
+
+  if (bc->zring) {
+    return bc->zring->size;
+  }
+
+  if (!bc->buffer) {
+    return 0;
+  }
+
+  pages = (bc->buffer_bytes + page - 1) / page;
+  vec = malloc(pages);
+  if (!vec) {
+    return 0;
+  }
+  if (!mincore(bc->buffer, bc->buffer_bytes, vec)) {
+    for (i = 0; i < pages; i++) {
+      bytes += (vec[i] & 1) ? page : 0;
+    }
+  }
+  free(vec);
+
+  return bytes;
+}
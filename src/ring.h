@@ -0,0 +1,31 @@
+#ifndef __RING_H
+#define __RING_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+#define SPILL_CHUNK_BYTES  (1024 * 1024) /* size of each file read/write */
+#define SPILL_ALIGN        4096          /* file offset alignment of chunks */
+#define SPILL_MIN_HOT      4             /* minimum chunks kept in RAM */
+#define SPILL_READAHEAD    4             /* chunks read ahead of play pointer */
+
+#define ELASTIC_CHUNK_BYTES (256 * 1024) /* RAM is committed/released in chunks */
+#define ELASTIC_MIN_CHUNKS  4               /* smaller buffers are fixed */
+
+#define RING_MAX_SPAN      8    /* most periods read or written at once
+                                   (at most DSP_MAX_STRETCH) */
+
+#define ZRING_RATIO        2    /* expected compression ratio (sizes the index) */
+#define ZRING_CACHE        4    /* decoded periods kept around play pointer */
+#define ZRING_STATS        500  /* periods between verbose codec stats */
+
+int ring_init(buffer_config_t *bc, settings_t *settings);
+void ring_cleanup(buffer_config_t *bc);
+uint8_t *ring_period_ptr(buffer_config_t *bc, unsigned int period);
+uint8_t *ring_span_ptr(buffer_config_t *bc, unsigned int period,
+                       unsigned int count);
+uint8_t *ring_map_twice(int fd, size_t head, size_t bytes);
+void ring_captured(buffer_config_t *bc);
+void ring_played(buffer_config_t *bc);
+uint64_t ring_resident_bytes(buffer_config_t *bc);
+#endif
@@ -12,15 +12,43 @@ static void usage(settings_t *settings, int retcode)
 {
   printf("nojoebuck [options]...\n");
   printf("  -b, --bits=[16|24|32]  Bit depth.  Default: %d\n", settings->bits);
+  printf("  -B, --play-bits=[16|24|32]\n"
+         "                         Playback bit depth.  Default: same as --bits\n");
   printf("  -c, --capture=NAME     Name of capture interface (list with aplay -L)."
          "  Default: %s\n", settings->cap_int);
+  printf("  -E, --dsp=SPEC         Add a processing block to the playback path (see\n"
+         "                         dsp.h for SPEC).  May be repeated (up to %d)\n",
+         DSP_MAX_BLOCKS);
+  printf("  -f, --spill=FILE       Keep the delay buffer in FILE with --memory of it\n"
+         "                         cached in RAM.  Allows delays beyond RAM size\n");
+  printf("  -F, --record-flac      Record FLAC files instead of WAV\n");
   printf("  -h, --help             This usage message\n");
   printf("  -m, --memory=SIZE      Memory buffer to reserve in MB.  Default: %.1f\n",
          settings->memory/(1024.0*1024.0));
+  printf("  -M, --play-map=MAP     Capture channel for each playback channel, i.e.\n"
+         "                         '0,1,0,1' (quad) or 'm' (mono mix).  Default: 0,1\n");
+  printf("  -n, --net=HOST:PORT[,MS]  Also stream delayed audio as RTP to HOST:PORT\n"
+         "                         (unicast or multicast), MS later than the delay\n"
+         "                         setting.  May be repeated (up to %d clients)\n",
+         NET_MAX_CLIENTS);
   printf("  -p, --playback=NAME    Name of playback interface (list with aplay -L)."
          "  Default: %s\n", settings->play_int);
+  printf("  -P, --play-rate=RATE   Playback sample rate.  Default: same as --rate\n");
+  printf("  -q, --quiet=DBFS       Drop or extend periods quieter than DBFS (i.e. -45)\n"
+         "                         to change delay before changing playback speed\n");
+  printf("  -R, --record=DIR       Allow recording (started by UI command) to DIR\n");
   printf("  -r, --rate=RATE        Sample rate.  Default: %d\n", settings->rate);
+  printf("  -S, --spill-size=SIZE  Size of spill file in MB.  Default: %llu\n",
+         (unsigned long long)settings->spill_size/(1024*1024));
+  printf("  -s, --seek             Jump to new delay settings instead of changing\n"
+         "                         playback speed\n");
+  printf("  -t, --tap=SOCKET       Share the delay buffer read-only with local readers\n"
+         "                         which connect to SOCKET (see nojoebuck-client.h)\n");
+  printf("  -T, --trace=DIR        Write period traces (on SIGUSR1 or xrun) to DIR.\n"
+         "                         Default: %s\n", settings->trace_dir);
   printf("  -v, --verbose          Verbose outout\n");
+  printf("  -z, --compress         Losslessly compress the buffer to allow longer\n"
+         "                         delays in the same memory\n");
   printf("  -w, --wait             Wait for specified interfaces to become available\n");
 
   exit(retcode);
@@ -38,16 +66,30 @@ void settings_get_opts(settings_t *settings, int argc, char *argv[])
     static struct option long_options[] =
     {
       {"bits",      required_argument,  NULL, 'b'},
+      {"play-bits", required_argument,  NULL, 'B'},
       {"capture",   required_argument,  NULL, 'c'},
+      {"dsp",       required_argument,  NULL, 'E'},
+      {"spill",     required_argument,  NULL, 'f'},
       {"help",      no_argument,        NULL, 'h'},
       {"memory",    required_argument,  NULL, 'm'},
+      {"play-map",  required_argument,  NULL, 'M'},
+      {"net",       required_argument,  NULL, 'n'},
       {"playback",  required_argument,  NULL, 'p'},
+      {"play-rate", required_argument,  NULL, 'P'},
+      {"quiet",     required_argument,  NULL, 'q'},
       {"rate",      required_argument,  NULL, 'r'},
+      {"record",    required_argument,  NULL, 'R'},
+      {"record-flac",no_argument,       NULL, 'F'},
+      {"seek",      no_argument,        NULL, 's'},
+      {"spill-size",required_argument,  NULL, 'S'},
+      {"tap",       required_argument,  NULL, 't'},
+      {"trace",     required_argument,  NULL, 'T'},
       {"verbose",   no_argument,        NULL, 'v'},
+      {"compress",  no_argument,        NULL, 'z'},
       {NULL, 0, NULL, 0}
     };
 
-    c = getopt_long (argc, argv, "b:c:hm:p:r:vw",
+    c = getopt_long (argc, argv, "b:B:c:E:f:Fhm:M:n:p:P:q:r:R:sS:t:T:vwz",
                        long_options, &option_index);
 
     /* Detect the end of the options. */
@@ -66,6 +108,15 @@ void settings_get_opts(settings_t *settings, int argc, char *argv[])
         settings->bits = v;
         break;
 
+      case 'B':
+        v = atol(optarg);
+        if ((v != 16) && (v != 24) && (v != 32)) {
+            printf ("option -B: invalid bit depth\n");
+            usage(settings, -1);
+        }
+        settings->play_bits = v;
+        break;
+
       case 'h':
       case '?':
 	usage(settings, 0);
@@ -79,13 +130,69 @@ void settings_get_opts(settings_t *settings, int argc, char *argv[])
 	settings->wait = 1;
         break;
 
+      case 's':
+	settings->seek = 1;
+        break;
+
+      case 'z':
+	settings->compress = 1;
+        break;
+
+      case 'F':
+	settings->record_flac = 1;
+        break;
+
       case 'c':
         strncpy(settings->cap_int, optarg, MAX_AUDIO_DEVNAME_LEN);
         settings->cap_int[MAX_AUDIO_DEVNAME_LEN-1] = '\0';
         break;
 
       case 'm':
-        settings->memory = atol(optarg) * 1024 * 1024;
+        settings->memory = strtoull(optarg, NULL, 10) * 1024 * 1024;
+        break;
+
+      case 'f':
+        strncpy(settings->spill_file, optarg, MAX_PATH_LEN);
+        settings->spill_file[MAX_PATH_LEN-1] = '\0';
+        break;
+
+      case 'S':
+        settings->spill_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+        break;
+
+      case 't':
+        strncpy(settings->tap, optarg, MAX_PATH_LEN);
+        settings->tap[MAX_PATH_LEN-1] = '\0';
+        break;
+
+      case 'T':
+        strncpy(settings->trace_dir, optarg, MAX_PATH_LEN);
+        settings->trace_dir[MAX_PATH_LEN-1] = '\0';
+        break;
+
+      case 'M':
+        strncpy(settings->play_map, optarg, MAX_PLAY_MAP_LEN);
+        settings->play_map[MAX_PLAY_MAP_LEN-1] = '\0';
+        break;
+
+      case 'n':
+        if (settings->num_net >= NET_MAX_CLIENTS) {
+            printf ("option -n: too many network clients\n");
+            usage(settings, -1);
+        }
+        strncpy(settings->net[settings->num_net], optarg, MAX_NET_ADDR_LEN);
+        settings->net[settings->num_net][MAX_NET_ADDR_LEN-1] = '\0';
+        settings->num_net++;
+        break;
+
+      case 'E':
+        if (settings->num_dsp >= DSP_MAX_BLOCKS) {
+            printf ("option -E: too many processing blocks\n");
+            usage(settings, -1);
+        }
+        strncpy(settings->dsp[settings->num_dsp], optarg, MAX_DSP_SPEC_LEN);
+        settings->dsp[settings->num_dsp][MAX_DSP_SPEC_LEN-1] = '\0';
+        settings->num_dsp++;
         break;
 
       case 'p':
@@ -93,6 +200,24 @@ void settings_get_opts(settings_t *settings, int argc, char *argv[])
         settings->play_int[MAX_AUDIO_DEVNAME_LEN-1] = '\0';
         break;
 
+      case 'P':
+        settings->play_rate = atol(optarg);
+        break;
+
+      case 'q':
+        v = atol(optarg);
+        if ((v >= 0) || (v < -96)) {
+            printf ("option -q: level must be between -96 and -1 dBFS\n");
+            usage(settings, -1);
+        }
+        settings->quiet_dbfs = v;
+        break;
+
+      case 'R':
+        strncpy(settings->record_dir, optarg, MAX_PATH_LEN);
+        settings->record_dir[MAX_PATH_LEN-1] = '\0';
+        break;
+
       case 'r':
         settings->rate = atol(optarg);
         break;
@@ -110,6 +235,18 @@ void settings_get_opts(settings_t *settings, int argc, char *argv[])
   else if (settings->bits == 32)
       settings->format = SND_PCM_FORMAT_S32_LE;
 
+  /* Playback defaults to the capture settings */
+  if (!settings->play_bits)
+      settings->play_bits = settings->bits;
+  if (!settings->play_rate)
+      settings->play_rate = settings->rate;
+  if (settings->play_bits == 16)
+      settings->play_format = SND_PCM_FORMAT_S16_LE;
+  else if (settings->play_bits == 24)
+      settings->play_format = SND_PCM_FORMAT_S24_LE;
+  else
+      settings->play_format = SND_PCM_FORMAT_S32_LE;
+
   if (settings->verbose) {
     printf("Settings:\n");
     printf("  Capture:   %s\n", settings->cap_int);
@@ -118,6 +255,30 @@ void settings_get_opts(settings_t *settings, int argc, char *argv[])
     printf("  Depth:     %d [%s (%s)]\n", settings->bits,
            snd_pcm_format_name(settings->format),
            snd_pcm_format_description(settings->format));
-    printf("  Memory:    %dMB\n", settings->memory/1024/1024);
+    if ((settings->play_bits != settings->bits) ||
+        (settings->play_rate != settings->rate) || settings->play_map[0])
+      printf("  Play:      %d bit  %d Hz  map %s\n", settings->play_bits,
+             settings->play_rate,
+             settings->play_map[0] ? settings->play_map : "0,1");
+    printf("  Memory:    %lluMB\n", (unsigned long long)settings->memory/1024/1024);
+    if (settings->spill_file[0])
+      printf("  Spill:     %s (%lluMB)\n", settings->spill_file,
+             (unsigned long long)settings->spill_size/1024/1024);
+    printf("  Seek:      %s\n", settings->seek ? "yes" : "no");
+    printf("  Compress:  %s\n", settings->compress ? "yes" : "no");
+    if (settings->tap[0])
+      printf("  Tap:       %s\n", settings->tap);
+    printf("  Trace:     %s\n", settings->trace_dir);
+    if (settings->quiet_dbfs)
+      printf("  Quiet:     %d dBFS\n", settings->quiet_dbfs);
+    else
+      printf("  Quiet:     off\n");
+    if (settings->record_dir[0])
+      printf("  Record:    %s (%s)\n", settings->record_dir,
+             settings->record_flac ? "FLAC" : "WAV");
+    for (c = 0; c < settings->num_net; c++)
+      printf("  Net:       %s\n", settings->net[c]);
+    for (c = 0; c < settings->num_dsp; c++)
+      printf("  DSP:       %s\n", settings->dsp[c]);
   }
 }
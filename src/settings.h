@@ -2,17 +2,42 @@
 #define __SETTINGS_H
 
 #define MAX_AUDIO_DEVNAME_LEN  64
+#define MAX_PATH_LEN           256
+#define MAX_NET_ADDR_LEN       80
+#define NET_MAX_CLIENTS        64
+#define DSP_MAX_BLOCKS         16
+#define MAX_DSP_SPEC_LEN       48
+#define MAX_PLAY_MAP_LEN       32
 
 typedef struct settings {
   char cap_int[MAX_AUDIO_DEVNAME_LEN];
   char play_int[MAX_AUDIO_DEVNAME_LEN];
   uint32_t rate;
-  uint32_t memory;
+  uint64_t memory;
   uint8_t bits;
   uint8_t verbose;
   snd_pcm_format_t format;
+  uint8_t play_bits;
+  uint32_t play_rate;
+  snd_pcm_format_t play_format;
+  char play_map[MAX_PLAY_MAP_LEN];
   uint32_t delay_ms;
   uint8_t wait;
+  uint8_t seek;
+  int quiet_dbfs;
+  char spill_file[MAX_PATH_LEN];
+  uint64_t spill_size;
+  uint8_t compress;
+  char net[NET_MAX_CLIENTS][MAX_NET_ADDR_LEN];
+  unsigned int num_net;
+  char record_dir[MAX_PATH_LEN];
+  uint8_t record_flac;
+  char dsp[DSP_MAX_BLOCKS][MAX_DSP_SPEC_LEN];
+  unsigned int num_dsp;
+  char tap[MAX_PATH_LEN];
+  char trace_dir[MAX_PATH_LEN];  /* where trace dumps are written */
+  char ui_cmd[MAX_PATH_LEN];     /* ZMQ endpoints ("" = default) */
+  char ui_status[MAX_PATH_LEN];
 } settings_t;
 
 void settings_get_opts(settings_t *settings, int argc, char *argv[]);
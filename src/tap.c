@@ -0,0 +1,279 @@
+/* memfd_create(), accept4() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "ring.h"
+#include "tap.h"
+#include "nojoebuck-client.h"
+
+/*
+ * Shared memory tap
+ *
+ * The RAM delay buffer is placed in a memfd, preceded by a page holding a
+ * header (njb_tap_header_t in nojoebuck-client.h) with the format, the ring
+ * size and the capture and play cursors.  Local readers connect to a Unix
+ * socket and are handed a read-only descriptor of the memfd (SCM_RIGHTS),
+ * which they map to follow the live or delayed audio in place.  The engine
+ * maps the buffer twice (ring_map_twice()) when it can, readers need not.
+ *
+ * The audio thread only stores the cursors; it never waits for readers and
+ * doesn't know how many there are.  Readers which fall more than a ring
+ * behind find their audio overwritten (see njb_tap_valid()).
+ */
+
+typedef struct tap {
+  int memfd;
+  int ro_fd;                /* read-only descriptor handed to readers */
+  int sock;
+  char path[MAX_PATH_LEN];
+  uint8_t *map;             /* header page followed by the delay buffer */
+  size_t map_bytes;
+  njb_tap_header_t *hdr;
+  uint64_t cap_seq;
+  pthread_t thread;
+  bool running;
+} tap_t;
+
+/* hand 'fd' to the reader on 'conn' */
+static int send_fd(int conn, int fd) {
+  char msg[] = "NJBT";
+  char ctrl[CMSG_SPACE(sizeof(int))] = { 0 };
+  struct iovec iov = { .iov_base = msg, .iov_len = sizeof(msg) };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = ctrl,
+    .msg_controllen = sizeof(ctrl),
+  };
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+  return (sendmsg(conn, &mh, MSG_NOSIGNAL) < 0) ? -errno : 0;
+}
+
+static void *tap_thread(void *data) {
+  buffer_config_t *bc = (buffer_config_t *)data;
+  tap_t *tp = bc->tap;
+  int conn, err;
+
+  while (tp->running) {
+    conn = accept4(tp->sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (tp->running && (errno != EINTR)) {
+        fprintf(stderr, "Tap accept failed (%s)\n", strerror(errno));
+        usleep(100000);
+      }
+      continue;
+    }
+
+    if ((err = send_fd(conn, tp->ro_fd)) < 0) {
+      fprintf(stderr, "Could not hand out tap (%s)\n", strerror(-err));
+    } else if (bc->verbose) {
+      printf("Tap reader connected\n");
+    }
+    close(conn);
+  }
+
+  return NULL;
+}
+
+static int tap_listen(tap_t *tp) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  if (strlen(tp->path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Tap socket path too long: %s\n", tp->path);
+    return -ENAMETOOLONG;
+  }
+  strcpy(addr.sun_path, tp->path);
+
+  tp->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (tp->sock < 0) {
+    return -errno;
+  }
+
+  /* a socket left behind by a previous run */
+  unlink(tp->path);
+  if (bind(tp->sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(tp->sock, TAP_BACKLOG)) {
+    fprintf(stderr, "cannot listen on tap socket %s (%s)\n",
+            tp->path, strerror(errno));
+    return -errno;
+  }
+  chmod(tp->path, 0660);
+
+  return 0;
+}
+
+/*
+ * External Interface Functions
+ */
+
+/* Allocate the delay buffer (bc->buffer_bytes) in shared memory and start
+ * handing it out.  Called by ring_init() instead of reserving RAM */
+int tap_init(buffer_config_t *bc, settings_t *settings) {
+  char proc[32];
+  size_t page = sysconf(_SC_PAGESIZE);
+  tap_t *tp;
+  int err;
+
+  tp = calloc(1, sizeof(*tp));
+  if (!tp) {
+    return -ENOMEM;
+  }
+  tp->memfd = tp->ro_fd = tp->sock = -1;
+  strncpy(tp->path, settings->tap, MAX_PATH_LEN);
+  tp->path[MAX_PATH_LEN-1] = '\0';
+  bc->tap = tp;
+
+  tp->map_bytes = page + bc->buffer_bytes;
+  tp->memfd = memfd_create("nojoebuck", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if ((tp->memfd < 0) || ftruncate(tp->memfd, tp->map_bytes)) {
+    err = -errno;
+    fprintf(stderr, "Could not create tap memory (%s)\n", strerror(errno));
+    goto fail;
+  }
+  fcntl(tp->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+  /* reopening through /proc gives a descriptor readers can't write with */
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", tp->memfd);
+  tp->ro_fd = open(proc, O_RDONLY | O_CLOEXEC);
+  if (tp->ro_fd < 0) {
+    err = -errno;
+    fprintf(stderr, "Could not reopen tap memory (%s)\n", strerror(errno));
+    goto fail;
+  }
+
+  if (!(bc->buffer_bytes % page) &&
+      (tp->map = ring_map_twice(tp->memfd, page, bc->buffer_bytes))) {
+    tp->map_bytes += bc->buffer_bytes;
+    bc->magic = true;
+  } else {
+    tp->map = mmap(NULL, tp->map_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_NORESERVE, tp->memfd, 0);
+  }
+  if (tp->map == MAP_FAILED) {
+    tp->map = NULL;
+    err = -ENOMEM;
+    fprintf(stderr, "Could allocate buffer memory\n");
+    goto fail;
+  }
+
+  tp->hdr = (njb_tap_header_t *)tp->map;
+  tp->hdr->magic = NJB_TAP_MAGIC;
+  tp->hdr->version = NJB_TAP_VERSION;
+  tp->hdr->header_bytes = page;
+  tp->hdr->format = bc->format;
+  tp->hdr->rate = bc->rate;
+  tp->hdr->channels = bc->channels;
+  tp->hdr->frame_bytes = bc->frame_bytes;
+  tp->hdr->period_frames = bc->period_frames;
+  tp->hdr->period_bytes = bc->period_bytes;
+  tp->hdr->num_periods = bc->buffer_bytes / bc->period_bytes;
+  tp->hdr->write_ahead = bc->write_ahead_p;
+  bc->buffer = tp->map + page;
+
+  if ((err = tap_listen(tp)) < 0) {
+    goto fail;
+  }
+
+  tp->running = true;
+  if (pthread_create(&tp->thread, NULL, tap_thread, bc)) {
+    tp->running = false;
+    err = -1;
+    fprintf(stderr, "Could not create tap thread\n");
+    goto fail;
+  }
+
+  if (settings->verbose) {
+    printf("Tap:\n");
+    printf("  Socket:       %s\n", tp->path);
+  }
+
+  return 0;
+
+fail:
+  tap_cleanup(bc);
+  return err;
+}
+
+void tap_cleanup(buffer_config_t *bc) {
+  tap_t *tp = bc->tap;
+
+  if (!tp) {
+    return;
+  }
+
+  /* shutdown() wakes the thread from accept() */
+  if (tp->running) {
+    tp->running = false;
+    shutdown(tp->sock, SHUT_RDWR);
+    pthread_join(tp->thread, NULL);
+  }
+  if (tp->sock >= 0) {
+    close(tp->sock);
+    unlink(tp->path);
+  }
+
+  /* readers keep their own mapping until they close it */
+  if (tp->map) {
+    munmap(tp->map, tp->map_bytes);
+    bc->buffer = NULL;
+    bc->magic = false;
+  }
+  if (tp->ro_fd >= 0) {
+    close(tp->ro_fd);
+  }
+  if (tp->memfd >= 0) {
+    close(tp->memfd);
+  }
+  free(tp);
+  bc->tap = NULL;
+}
+
+/* called by the audio thread after the capture pointer advances */
+void tap_captured(buffer_config_t *bc) {
+  tap_t *tp = bc->tap;
+  unsigned int last;
+
+  if (!tp) {
+    return;
+  }
+
+  last = (bc->cap ? bc->cap : bc->mem_num_periods) - 1;
+  tp->cap_seq++;
+  __atomic_store_n(&tp->hdr->cap_ns, bc->cap_ns ? bc->cap_ns[last] : 0,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&tp->hdr->cap_seq, tp->cap_seq, __ATOMIC_RELEASE);
+}
+
+/* called by the audio thread after the play pointer moves */
+void tap_played(buffer_config_t *bc) {
+  tap_t *tp = bc->tap;
+  unsigned int n = bc->mem_num_periods;
+
+  if (!tp) {
+    return;
+  }
+
+  __atomic_store_n(&tp->hdr->play_seq,
+                   tp->cap_seq - (bc->cap + n - bc->play) % n,
+                   __ATOMIC_RELEASE);
+}
@@ -0,0 +1,13 @@
+#ifndef __TAP_H
+#define __TAP_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+#define TAP_BACKLOG  8   /* readers waiting to be handed the buffer */
+
+int tap_init(buffer_config_t *bc, settings_t *settings);
+void tap_cleanup(buffer_config_t *bc);
+void tap_captured(buffer_config_t *bc);
+void tap_played(buffer_config_t *bc);
+#endif
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <alsa/asoundlib.h>
+
+#include "nojoebuck.h"
+#include "settings.h"
+#include "trace.h"
+
+/*
+ * Period trace
+ *
+ * A fixed ring of the most recent TRACE_EVENTS events, always recording:
+ * the monotonic start time and duration of each stage of each period (see
+ * trace.h) with the playback state, the buffer cursors and the ALSA buffer
+ * fill last seen by the audio thread (never queried for the trace).
+ * Recording is a clock read, one atomic increment and a few stores, so any
+ * thread can record without locking and without disturbing the timing
+ * being measured.
+ *
+ * On SIGUSR1 (nojoebuck.c) or an xrun the dump thread writes the ring to
+ * DIR/nojoebuck-trace-PID-N.json in Chrome trace event format, which
+ * Perfetto (ui.perfetto.dev) and chrome://tracing open directly.  Events
+ * being overwritten while the ring is copied are left out.
+ */
+
+typedef struct trace_event {
+  uint64_t seq;             /* index + 1 once the event is complete */
+  uint64_t start_ns;
+  uint32_t dur_ns;
+  uint32_t tid;
+  uint32_t cap;
+  uint32_t play;
+  uint32_t frames;
+  int32_t fill;             /* frames in the ALSA buffer (-1 unknown) */
+  uint8_t stage;
+  uint8_t state;
+} trace_event_t;
+
+static const char *stage_names[TRACE_STAGES] = {
+  [TRACE_READ] = "read",
+  [TRACE_STRETCH] = "stretch",
+  [TRACE_PROCESS] = "process",
+  [TRACE_WRITE] = "write",
+  [TRACE_LOCK] = "lock wait",
+  [TRACE_OVERRUN] = "capture overrun",
+  [TRACE_UNDERRUN] = "playback underrun",
+};
+
+static trace_event_t *events = NULL;
+static uint64_t head = 0;           /* next event index */
+static buffer_config_t *trace_bc = NULL;
+static char trace_dir[MAX_PATH_LEN];
+static pthread_t dump_thread;
+static sem_t dump_wake;
+static bool running = false;
+static unsigned int dumps = 0;
+static uint64_t last_xrun_dump = 0; /* audio thread only */
+static __thread uint32_t tid = 0;
+
+/* copy the events still in the ring, oldest first.  Returns the count */
+static unsigned int trace_snapshot(trace_event_t *copy) {
+  uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  uint64_t idx = (end > TRACE_EVENTS) ? end - TRACE_EVENTS : 0;
+  trace_event_t *ev;
+  unsigned int n = 0;
+  uint64_t seq;
+
+  for (; idx < end; idx++) {
+    ev = &events[idx & (TRACE_EVENTS - 1)];
+    seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+    copy[n] = *ev;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((seq == idx + 1) &&
+        (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) == seq)) {
+      n++;
+    }
+  }
+
+  return n;
+}
+
+static void trace_dump(void) {
+  trace_event_t *copy;
+  unsigned int i, n;
+  unsigned int num_p = trace_bc->mem_num_periods;
+  trace_event_t *ev;
+  char path[MAX_PATH_LEN + 48];
+  int pid = getpid();
+  FILE *f;
+
+  copy = malloc(TRACE_EVENTS * sizeof(*copy));
+  if (!copy) {
+    fprintf(stderr, "%s() Memory error\n", __func__);
+    return;
+  }
+  n = trace_snapshot(copy);
+
+  snprintf(path, sizeof(path), "%s/nojoebuck-trace-%d-%u.json", trace_dir,
+           pid, ++dumps);
+  f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "Could not write trace %s (%s)\n", path, strerror(errno));
+    free(copy);
+    return;
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (i = 0; i < n; i++) {
+    ev = &copy[i];
+    if ((ev->stage == TRACE_OVERRUN) || (ev->stage == TRACE_UNDERRUN)) {
+      fprintf(f, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,"
+              "\"pid\":%d,\"tid\":%u,", stage_names[ev->stage],
+              ev->start_ns / 1000.0, pid, ev->tid);
+    } else {
+      fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+              "\"pid\":%d,\"tid\":%u,", stage_names[ev->stage],
+              ev->start_ns / 1000.0, ev->dur_ns / 1000.0, pid, ev->tid);
+    }
+    fprintf(f, "\"args\":{\"state\":\"%s\",\"cap\":%u,\"play\":%u,"
+            "\"buffered\":%u,\"frames\":%u,\"fill\":%d}},\n",
+            STATE_NAME(ev->state), ev->cap, ev->play,
+            (ev->cap + num_p - ev->play) % num_p, ev->frames, ev->fill);
+
+    /* ALSA buffer fill as counter tracks */
+    if ((ev->fill >= 0) &&
+        ((ev->stage == TRACE_READ) || (ev->stage == TRACE_WRITE))) {
+      fprintf(f, "{\"name\":\"%s fill\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+              "\"args\":{\"frames\":%d}},\n",
+              (ev->stage == TRACE_READ) ? "capture" : "playback",
+              (ev->start_ns + ev->dur_ns) / 1000.0, pid, ev->fill);
+    }
+  }
+  /* marks the time of the dump and closes the array */
+  fprintf(f, "{\"name\":\"dump\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,"
+          "\"pid\":%d,\"tid\":0}\n]}\n", trace_now() / 1000.0, pid);
+
+  if (fclose(f)) {
+    fprintf(stderr, "Could not write trace %s (%s)\n", path, strerror(errno));
+  } else if (CAN_PRINT(trace_bc)) {
+    printf("Trace of %u events written to %s\n", n, path);
+  }
+  free(copy);
+}
+
+static void *trace_thread(void *ptr) {
+  while (1) {
+    while (sem_wait(&dump_wake) && (errno == EINTR));
+    /* requests made while dumping are covered by this dump */
+    while (!sem_trywait(&dump_wake));
+    if (!running) {
+      break;
+    }
+    trace_dump();
+  }
+
+  return NULL;
+}
+
+/*
+ * External Interface Functions
+ */
+uint64_t trace_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* record a stage which started at start_ns and ends now.  Any thread */
+void trace_event(buffer_config_t *bc, int stage, uint64_t start_ns,
+                 unsigned int frames, long fill) {
+  uint64_t end = trace_now();
+  trace_event_t *ev;
+  uint64_t idx;
+
+  if (!events) {
+    return;
+  }
+  if (!tid) {
+    tid = syscall(SYS_gettid);
+  }
+
+  idx = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+  ev = &events[idx & (TRACE_EVENTS - 1)];
+  __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  ev->start_ns = start_ns;
+  ev->dur_ns = end - start_ns;
+  ev->tid = tid;
+  ev->cap = bc->cap;
+  ev->play = bc->play;
+  ev->frames = frames;
+  ev->fill = fill;
+  ev->stage = stage;
+  ev->state = bc->state;
+  __atomic_store_n(&ev->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/* record an xrun and dump the trace (at most every TRACE_XRUN_HOLDOFF s).
+ * Audio thread */
+void trace_xrun(buffer_config_t *bc, int stage, long fill) {
+  uint64_t now = trace_now();
+
+  trace_event(bc, stage, now, 0, fill);
+  if (!last_xrun_dump ||
+      (now - last_xrun_dump >= TRACE_XRUN_HOLDOFF * 1000000000ULL)) {
+    last_xrun_dump = now;
+    trace_dump_request();
+  }
+}
+
+/* ask the dump thread to write the trace.  Async signal safe */
+void trace_dump_request(void) {
+  if (running) {
+    sem_post(&dump_wake);
+  }
+}
+
+int trace_init(buffer_config_t *bc, settings_t *settings) {
+  /* commit the ring now so recording never page faults */
+  events = malloc(TRACE_EVENTS * sizeof(*events));
+  if (!events) {
+    fprintf(stderr, "Could not allocate trace memory\n");
+    return -ENOMEM;
+  }
+  memset(events, 0, TRACE_EVENTS * sizeof(*events));
+  head = 0;
+  last_xrun_dump = 0;
+  trace_bc = bc;
+  snprintf(trace_dir, sizeof(trace_dir), "%s",
+           settings->trace_dir[0] ? settings->trace_dir : "/tmp");
+
+  sem_init(&dump_wake, 0, 0);
+  running = true;
+  if (pthread_create(&dump_thread, NULL, trace_thread, NULL)) {
+    fprintf(stderr, "Could not create trace thread\n");
+    running = false;
+    trace_cleanup();
+    return -1;
+  }
+
+  if (settings->verbose) {
+    printf("Trace:\n");
+    printf("  Events:       %d\n", TRACE_EVENTS);
+    printf("  Dumps:        %s\n", trace_dir);
+  }
+
+  return 0;
+}
+
+void trace_cleanup(void) {
+  trace_event_t *ev = events;
+
+  if (!ev) {
+    return;
+  }
+
+  if (running) {
+    running = false;
+    sem_post(&dump_wake);
+    pthread_join(dump_thread, NULL);
+  }
+  sem_destroy(&dump_wake);
+
+  events = NULL;
+  free(ev);
+  trace_bc = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "nojoebuck.h"
+#include "settings.h"
+
+#define TRACE_EVENTS       32768  /* events kept (power of 2) */
+#define TRACE_XRUN_HOLDOFF 10     /* seconds between dumps caused by xruns */
+
+/* stages of a period (the trace event names are in trace.c) */
+enum trace_stage {
+  TRACE_READ,      /* capture readi (blocking) or plugin feed wait */
+  TRACE_STRETCH,   /* building a stretched/compressed period */
+  TRACE_PROCESS,   /* dsp and playback conversion */
+  TRACE_WRITE,     /* playback writei */
+  TRACE_LOCK,      /* waiting for the buffer lock to read the delay */
+  TRACE_OVERRUN,   /* capture overrun (instant) */
+  TRACE_UNDERRUN,  /* playback underrun (instant) */
+  TRACE_STAGES
+};
+
+uint64_t trace_now(void);
+/* fill is passed in rather than queried: recording never calls into ALSA */
+void trace_event(buffer_config_t *bc, int stage, uint64_t start_ns,
+                 unsigned int frames, long fill);
+void trace_xrun(buffer_config_t *bc, int stage, long fill);
+void trace_dump_request(void);
+int trace_init(buffer_config_t *bc, settings_t *settings);
+void trace_cleanup(void);
+#endif
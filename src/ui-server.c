@@ -2,11 +2,16 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <zmq.h>
 
 #include "nojoebuck.h"
 #include "audio.h"
+#include "recorder.h"
+#include "ring.h"
+#include "dsp.h"
+#include "nojoebuck-client.h"
 
 /*
  * UI command & control interface
@@ -24,6 +29,12 @@
  *               "B" - Buffer status
  *               "C" - Current delay status
  *               "D" - Delay setting status
+ *               "E" - Playback processing chain
+ *               "L" - Capture levels
+ *               "M" - Buffer memory
+ *               "R" - Recorder status
+ *               "T" - Capture time of audio playing
+ *               "U" - Status rate limit
  *               ""  - All status
  *
  * ASCII string message format: "[char]:[value]"
@@ -38,16 +49,71 @@
  * "B:"          request current buffer status 
  * "C:983"       N/A                           Current delay is 983 ms
  * "C:"          request current delay 
+ * "E:add,SPEC"  append processing block       N/A
+ *               (SPEC as in dsp.h)
+ * "E:set,2,SPEC" replace block 2              N/A
+ * "E:del,2"     remove block 2                N/A
+ * "E:clear"     remove all blocks             N/A
+ * "E:"          request processing chain      N/A
+ * "E:1/3,peak,1000,-3,1.4,2.1"
+ *               N/A                           Block 1 of 3 and its cost in uS
+ *                                             per period.  One message per
+ *                                             block, or "E:0/0" if empty.
+ *                                             Sent after every change.
+ * "L:250"       report levels at least every  N/A
+ *               250 ms for the next 5 s
+ *               (NJB_LEVEL_LEASE_MS).  Reports
+ *               go to every subscriber at the
+ *               fastest unexpired period any
+ *               client asked for; resend to
+ *               keep it
+ * "L:"          request levels since last     N/A
+ *               "L:" request
+ * "L:-60,-180,  N/A                           Peak and RMS capture level of each
+ *    -58,-175"                                channel in 0.1 dBFS since the last
+ *                                             report of the same kind (periodic
+ *                                             or requested; -960 is digital
+ *                                             silence)
+ * "M:6144"      N/A                           Delay buffer holds 6144 KB of RAM
+ * "M:"          request buffer memory
+ * "R:live"      start recording captured      N/A
+ *               audio (needs --record)
+ * "R:delayed"   start recording the audio as  N/A
+ *               it is played (with speed
+ *               changes, seeks and dsp)
+ * "R:off"       stop recording                N/A
+ * "R:"          request recorder status       N/A
+ * "R:live,nojoebuck-20240101-120000-live.wav"
+ *               N/A                           Recording to that file (in the
+ *                                             record directory)
+ * "R:off"       N/A                           Not recording
+ * "T:1700000000000"
+ *               play audio captured at that   report the wall clock time (ms
+ *               wall clock time (ms since     since the epoch) the audio now
+ *               the epoch), setting the delay playing was captured
+ * "T:"          request capture time          N/A
+ * "U:250"       send unsolicited status       report the rate limit
+ *               updates (B, C, D, M, R) no
+ *               more than every 250 ms
+ * "U:"          request rate limit            N/A
+ *
+ * Commands are handled as they arrive; all queued commands are handled
+ * before status is checked, so a burst of "D:" commands is answered with
+ * a single "D:" update.  libnojoebuck-client (client.c) wraps this protocol
+ * for C and Python UIs.
  */
 
 /*
  * The ZMQ interface are IPC for local (on machine) access.
  * Could be changed to TCP if a remote client needs access.
  */
-#define UI_STATUS         "ipc:///tmp/nojobuck_status"
-#define UI_CMD            "ipc:///tmp/nojobuck_cmd"
-#define MAX_UI_CMD         16
-#define UI_SLEEP_TIME_MS   50 /* sleep time for main polling loop */
+#define UI_STATUS         NJB_STATUS_ENDPOINT
+#define UI_CMD            NJB_CMD_ENDPOINT
+#define MAX_UI_CMD         NJB_MAX_MSG
+#define UI_SLEEP_TIME_MS   50 /* longest wait for commands between status checks */
+#define UI_STATUS_MIN_MS   50 /* default time between unsolicited updates */
+#define UI_MEM_CHECK_MS  1000 /* time between checks of buffer memory */
+#define UI_LEVEL_LEASES     8 /* different level periods held at once */
 
 /* local globals */
 static void *ui_cmd = NULL;
@@ -55,7 +121,30 @@ static void *zmq_context_cmd = NULL;
 static void *ui_status = NULL;
 static void *zmq_context_status = NULL;
 
-static int update_delay_setting(buffer_config_t *bc, unsigned int delay_ms) {
+/* level periods clients asked for ("L:ms") and when each lapses */
+static struct level_lease {
+  unsigned int ms;
+  uint64_t until;
+} level_leases[UI_LEVEL_LEASES];
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* wall clock (CLOCK_REALTIME) in ms since the epoch */
+static uint64_t unix_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* delay_ms is 64 bits so T: times far in the past are range checked rather
+ * than wrapped */
+static int update_delay_setting(buffer_config_t *bc, uint64_t delay_ms) {
 
   if (!bc) {
     fprintf(stderr, "%s() invalid call\n", __func__);
@@ -63,23 +152,25 @@ static int update_delay_setting(buffer_config_t *bc, unsigned int delay_ms) {
   }
 
   if (delay_ms > (bc->max_delay_ms)) {
-    fprintf(stderr, "Error: delay too large: %d\n", delay_ms);
+    fprintf(stderr, "Error: delay too large: %llu\n",
+            (unsigned long long)delay_ms);
     return -ERANGE;
   }
 
   if (delay_ms < (bc->min_delay_ms)) {
-    fprintf(stderr, "Error: delay too small: %d/%d\n", delay_ms, bc->min_delay_ms);
+    fprintf(stderr, "Error: delay too small: %llu/%d\n",
+            (unsigned long long)delay_ms, bc->min_delay_ms);
     return -ERANGE;
   }
 
   pthread_mutex_lock(&bc->lock);
-  bc->target_delta_p = (delay_ms * 1000) / bc->period_time;
+  bc->target_delta_p = ((uint64_t)delay_ms * 1000) / bc->period_time;
+  bc->target_delay_us = (uint64_t)delay_ms * 1000;
   pthread_mutex_unlock(&bc->lock);
 
   if (bc->verbose) {
-    printf ("Updated delay setting to %.1f sec (%d periods)\n",
-            (bc->target_delta_p * bc->period_time) / 1000000.0,
-            bc->target_delta_p);
+    printf ("Updated delay setting to %.3f sec (%d periods)\n",
+            bc->target_delay_us / 1000000.0, bc->target_delta_p);
   }
 
   return 0;
@@ -116,7 +207,7 @@ static int ui_send_delay_setting(buffer_config_t *bc) {
   if (!bc)
   return -1;
 
-  delay = (bc->target_delta_p * bc->period_time) / 1000;
+  delay = bc->target_delay_us / 1000;
 
   snprintf(buffer, MAX_UI_CMD, "D:%d", delay);
 
@@ -141,7 +232,7 @@ static int ui_send_current_delay(buffer_config_t *bc) {
   if (!bc)
   return -1;
 
-  delay = (get_actual_delta(bc) * bc->period_time) / 1000;
+  delay = get_actual_delay_us(bc) / 1000;
   snprintf(buffer, MAX_UI_CMD, "C:%d", delay);
 
   if (bc->verbose) {
@@ -157,13 +248,251 @@ static int ui_send_current_delay(buffer_config_t *bc) {
   return delay;
 }
 
+/* wall clock time the audio playing now was captured */
+static int ui_send_time(buffer_config_t *bc) {
+
+  char buffer[MAX_UI_CMD+1];
+
+  if (!bc)
+  return -1;
+
+  snprintf(buffer, MAX_UI_CMD, "T:%llu",
+           (unsigned long long)(unix_ms() - get_actual_delay_us(bc) / 1000));
+
+  if (bc->verbose) {
+    printf("UI send %s\n", buffer);
+  }
+
+  if (strlen(buffer) != zmq_send (ui_status, buffer,
+                                  strlen(buffer), 0)) {
+    fprintf(stderr, "Error sending zmq msg [%s]: %s\n",
+            buffer, strerror(errno));
+  }
+
+  return 0;
+}
+
+/* query: answer an "L:" request rather than send a periodic report.  Each
+ * has its own accumulator so neither resets the other's levels */
+static int ui_send_levels(buffer_config_t *bc, bool query) {
+
+  char buffer[MAX_UI_CMD+1];
+  meter_levels_t *acc;
+  meter_levels_t levels;
+  unsigned int chan;
+  int len;
+
+  if (!bc)
+  return -1;
+
+  /* take the levels accumulated since the last report and start over */
+  acc = query ? &bc->levels_query : &bc->levels;
+  pthread_mutex_lock(&bc->lock);
+  levels = *acc;
+  memset(acc, 0, sizeof(*acc));
+  pthread_mutex_unlock(&bc->lock);
+
+  len = snprintf(buffer, MAX_UI_CMD, "L:");
+  for (chan = 0; (chan < bc->channels) && (chan < METER_MAX_CHANNELS); chan++) {
+    len += snprintf(buffer + len, MAX_UI_CMD - len, "%s%d,%d",
+                    chan ? "," : "", meter_peak_db10(&levels, chan),
+                    meter_rms_db10(&levels, chan));
+    if (len >= MAX_UI_CMD) {
+      len = MAX_UI_CMD - 1;
+      break;
+    }
+  }
+
+  if (bc->verbose) {
+    printf("UI send %s\n", buffer);
+  }
+
+  if (len != zmq_send (ui_status, buffer, len, 0)) {
+    fprintf(stderr, "Error sending zmq msg [%s]: %s\n",
+            buffer, strerror(errno));
+  }
+
+  return 0;
+}
+
+/* returns resident buffer memory in KB */
+/* start or renew a lease on a level period.  With no free slot the lease
+ * closest to lapsing is replaced */
+static void level_lease_renew(unsigned int ms, uint64_t now) {
+  struct level_lease *lease = &level_leases[0];
+  unsigned int i;
+
+  for (i = 0; i < UI_LEVEL_LEASES; i++) {
+    if ((level_leases[i].ms == ms) || (level_leases[i].until <= now)) {
+      lease = &level_leases[i];
+      break;
+    }
+    if (level_leases[i].until < lease->until) {
+      lease = &level_leases[i];
+    }
+  }
+  lease->ms = ms;
+  lease->until = now + NJB_LEVEL_LEASE_MS;
+}
+
+/* fastest level period still leased, or 0 for no periodic reports */
+static unsigned int level_period(uint64_t now) {
+  unsigned int i, ms = 0;
+
+  for (i = 0; i < UI_LEVEL_LEASES; i++) {
+    if ((level_leases[i].until > now) &&
+        (!ms || (level_leases[i].ms < ms))) {
+      ms = level_leases[i].ms;
+    }
+  }
+  return ms;
+}
+
+static unsigned int ui_send_memory(buffer_config_t *bc) {
+
+  char buffer[MAX_UI_CMD+1];
+  unsigned int kb;
+
+  if (!bc)
+  return 0;
+
+  kb = ring_resident_bytes(bc) / 1024;
+  snprintf(buffer, MAX_UI_CMD, "M:%d", kb);
+
+  if (bc->verbose) {
+    printf("UI send %s\n", buffer);
+  }
+
+  if (strlen(buffer) != zmq_send (ui_status, buffer,
+                                  strlen(buffer), 0)) {
+    fprintf(stderr, "Error sending zmq msg [%s]: %s\n",
+            buffer, strerror(errno));
+  }
+
+  return kb;
+}
+
+static int ui_send_dsp(buffer_config_t *bc) {
+
+  char buffer[MAX_UI_CMD+1];
+  unsigned int i, num;
+  int len;
+
+  if (!bc)
+  return -1;
+
+  num = dsp_num_blocks(bc);
+  for (i = 0; (i < num) || (!num && !i); i++) {
+    len = snprintf(buffer, MAX_UI_CMD, "E:%d/%d", num ? i : 0, num);
+    if (num) {
+      buffer[len++] = ',';
+      dsp_describe(bc, i, buffer + len, MAX_UI_CMD - len);
+    }
+
+    if (bc->verbose) {
+      printf("UI send %s\n", buffer);
+    }
+
+    if (strlen(buffer) != zmq_send (ui_status, buffer,
+                                    strlen(buffer), 0)) {
+      fprintf(stderr, "Error sending zmq msg [%s]: %s\n",
+              buffer, strerror(errno));
+    }
+  }
+
+  return num;
+}
+
+/* "add,SPEC", "set,IDX,SPEC", "del,IDX" or "clear" */
+static int ui_update_dsp(buffer_config_t *bc, char *cmd) {
+  char *end;
+  long idx;
+
+  if (!strncmp(cmd, "add,", 4)) {
+    return dsp_add(bc, cmd + 4);
+  }
+  if (!strcmp(cmd, "clear")) {
+    return dsp_clear(bc);
+  }
+
+  if (strncmp(cmd, "set,", 4) && strncmp(cmd, "del,", 4)) {
+    return -EINVAL;
+  }
+  idx = strtol(cmd + 4, &end, 10);
+  if ((end == cmd + 4) || (idx < 0)) {
+    return -EINVAL;
+  }
+  if (cmd[0] == 'd') {
+    return *end ? -EINVAL : dsp_remove(bc, idx);
+  }
+  return (*end == ',') ? dsp_set(bc, idx, end + 1) : -EINVAL;
+}
+
+static void ui_send_rate_limit(buffer_config_t *bc, unsigned int ms) {
+
+  char buffer[MAX_UI_CMD+1];
+
+  snprintf(buffer, MAX_UI_CMD, "U:%d", ms);
+
+  if (bc->verbose) {
+    printf("UI send %s\n", buffer);
+  }
+
+  if (strlen(buffer) != zmq_send (ui_status, buffer,
+                                  strlen(buffer), 0)) {
+    fprintf(stderr, "Error sending zmq msg [%s]: %s\n",
+            buffer, strerror(errno));
+  }
+}
+
+static rec_source_t ui_send_recorder(buffer_config_t *bc) {
+
+  char buffer[MAX_UI_CMD+1];
+  char name[MAX_REC_NAME];
+  rec_source_t source;
+
+  if (!bc)
+  return REC_OFF;
+
+  source = recorder_status(bc, name, sizeof(name));
+  if (source == REC_OFF) {
+    snprintf(buffer, MAX_UI_CMD, "R:off");
+  } else {
+    snprintf(buffer, MAX_UI_CMD, "R:%s,%s", REC_SOURCE_NAME(source), name);
+  }
+
+  if (bc->verbose) {
+    printf("UI send %s\n", buffer);
+  }
+
+  if (strlen(buffer) != zmq_send (ui_status, buffer,
+                                  strlen(buffer), 0)) {
+    fprintf(stderr, "Error sending zmq msg [%s]: %s\n",
+            buffer, strerror(errno));
+  }
+
+  return source;
+}
+
+/* allow group write and prevent world R/W/X on an ipc:// endpoint.  Set
+ * explicitly rather than with umask(), which would change it for the whole
+ * application the ALSA plugin runs in */
+static void ui_endpoint_perms(const char *endpoint) {
+  if (!strncmp(endpoint, "ipc://", 6) &&
+      chmod(endpoint + 6, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) {
+    fprintf(stderr, "Warning: could not set permissions of %s (%s)\n",
+            endpoint + 6, strerror(errno));
+  }
+}
+
 /*
  * External Interface Functions
  */
-int ui_init(buffer_config_t *bc) {
+int ui_init(buffer_config_t *bc, const char *cmd, const char *status) {
 
-  /* set umask to 007 to allow group write and prevent world R/W/X */
-  umask(S_IRWXO);
+  cmd = (cmd && cmd[0]) ? cmd : UI_CMD;
+  status = (status && status[0]) ? status : UI_STATUS;
+  memset(level_leases, 0, sizeof(level_leases));
 
   zmq_context_cmd = zmq_ctx_new();
   if (!zmq_context_cmd) {
@@ -178,16 +507,18 @@ int ui_init(buffer_config_t *bc) {
   }
 
   ui_status = zmq_socket (zmq_context_status, ZMQ_PUB);
-  if (0 != zmq_bind (ui_status, UI_STATUS)) {
-    fprintf(stderr, "Could not create outgoing zmq socket\n");
+  if (0 != zmq_bind (ui_status, status)) {
+    fprintf(stderr, "Could not create outgoing zmq socket %s\n", status);
     return -1;
   }
+  ui_endpoint_perms(status);
 
   ui_cmd = zmq_socket (zmq_context_cmd, ZMQ_PULL);
-  if (0 != zmq_bind (ui_cmd, UI_CMD)) {
-    fprintf(stderr, "Could not create incoming zmq socket\n");
+  if (0 != zmq_bind (ui_cmd, cmd)) {
+    fprintf(stderr, "Could not create incoming zmq socket %s\n", cmd);
     return -1;
   }
+  ui_endpoint_perms(cmd);
 
   return 0;
 }
@@ -196,18 +527,22 @@ int ui_cleanup(void) {
 
   if (ui_cmd) {
     zmq_close (ui_cmd);
+    ui_cmd = NULL;
   }
 
   if (ui_status) {
     zmq_close (ui_status);
+    ui_status = NULL;
   }
 
   if (zmq_context_cmd) {
     zmq_ctx_destroy (zmq_context_cmd);
+    zmq_context_cmd = NULL;
   }
 
   if (zmq_context_status) {
     zmq_ctx_destroy (zmq_context_status);
+    zmq_context_status = NULL;
   }
 
   return 0;
@@ -219,13 +554,31 @@ void *ui_server_thread(void *data) {
   char buffer[MAX_UI_CMD+1];
   unsigned int current_delay;
   unsigned int last_delay_setting = 0, last_buf = 0, last_current_delay=0;
+  unsigned int level_ms = 0;
+  rec_source_t last_rec = REC_OFF;
+  unsigned int last_mem_kb = 0;
+  unsigned int status_ms = UI_STATUS_MIN_MS;
+  uint64_t now, last_status_ms = 0, last_level_ms = 0, last_mem_ms = 0;
+  char rec_name[MAX_REC_NAME];
+  zmq_pollitem_t cmd_item = { ui_cmd, 0, ZMQ_POLLIN, 0 };
 
   while (bc->state) {
-    ret = zmq_recv (ui_cmd, buffer, MAX_UI_CMD, ZMQ_DONTWAIT);
-    if (ret < 0 && errno != EAGAIN) {
-      fprintf(stderr, "Error receiving zmq msg: %s\n", strerror(errno));
-    } else if (ret >= 0) {
+    /* sleep until a command arrives or it's time to check the status */
+    if ((zmq_poll(&cmd_item, 1, UI_SLEEP_TIME_MS) < 0) && (errno != EINTR)) {
+      fprintf(stderr, "Error polling zmq socket: %s\n", strerror(errno));
+    }
+
+    /* Handle every queued command before checking the status, so a burst
+     * of delay changes (i.e. from an encoder) is reported once */
+    while ((ret = zmq_recv (ui_cmd, buffer, MAX_UI_CMD, ZMQ_DONTWAIT)) >= 0) {
       char *token;
+
+      /* zmq_recv() returns the full length of a truncated message */
+      if (ret > MAX_UI_CMD) {
+        fprintf(stderr, "Ignoring UI command of %d bytes (max %d)\n",
+                ret, MAX_UI_CMD);
+        continue;
+      }
       buffer[ret] = '\0';
 
       if (bc->verbose)
@@ -261,13 +614,84 @@ void *ui_server_thread(void *data) {
         if (ret > 0) {
           last_current_delay = ret;
         }
+      } else if (token && !strcmp(token, "E")) {
+        token = strtok(NULL, ":");
+        if (token && (ui_update_dsp(bc, token) < 0)) {
+          fprintf(stderr, "Invalid processing command: %s\n", token);
+        }
+        ui_send_dsp(bc);
+      } else if (token && !strcmp(token, "L")) {
+        token = strtok(NULL, ":");
+        if (token) {
+          unsigned int ms = strtoul(token, NULL, 10);
+          now = now_ms();
+          /* reports start a period from now when none were running */
+          if (ms && !level_period(now)) {
+            last_level_ms = now;
+          }
+          if (ms) {
+            level_lease_renew(ms, now);
+          }
+        } else {
+          ui_send_levels(bc, true);
+        }
+      } else if (token && !strcmp(token, "M")) {
+        last_mem_kb = ui_send_memory(bc);
+      } else if (token && !strcmp(token, "R")) {
+        token = strtok(NULL, ":");
+        if (token && !strcmp(token, "live")) {
+          recorder_start(bc, REC_LIVE);
+        } else if (token && !strcmp(token, "delayed")) {
+          recorder_start(bc, REC_DELAYED);
+        } else if (token && !strcmp(token, "off")) {
+          recorder_stop(bc);
+        } else {
+          last_rec = ui_send_recorder(bc);
+        }
+      } else if (token && !strcmp(token, "T")) {
+        token = strtok(NULL, ":");
+        if (token) {
+          /* play what was captured at that wall clock time */
+          uint64_t at_ms = strtoull(token, NULL, 10);
+          uint64_t now_unix = unix_ms();
+          if (at_ms && (at_ms <= now_unix)) {
+            update_delay_setting(bc, now_unix - at_ms);
+          } else {
+            fprintf(stderr, "Ignoring capture time in the future\n");
+          }
+        }
+        ui_send_time(bc);
+      } else if (token && !strcmp(token, "U")) {
+        token = strtok(NULL, ":");
+        if (token) {
+          status_ms = strtol(token, NULL, 10);
+        }
+        ui_send_rate_limit(bc, status_ms);
       } else {
           fprintf(stderr, "Received invalid UI command: %s\n", buffer);
       }
     }
+    if (errno != EAGAIN) {
+      fprintf(stderr, "Error receiving zmq msg: %s\n", strerror(errno));
+    }
+
+    now = now_ms();
+
+    /* periodic level reports at the fastest rate any client still holds */
+    level_ms = level_period(now);
+    if (level_ms && (now - last_level_ms >= level_ms)) {
+      ui_send_levels(bc, false);
+      last_level_ms = now;
+    }
+
+    /* other status updates no more often than clients asked for */
+    if (now - last_status_ms < status_ms) {
+      continue;
+    }
+    last_status_ms = now;
 
     /* check for changes in delay seting since last report */
-    if (last_delay_setting != (bc->target_delta_p * bc->period_time) / 1000) {
+    if (last_delay_setting != bc->target_delay_us / 1000) {
       ret = ui_send_delay_setting(bc);
       if (ret > 0) {
         last_delay_setting = ret;
@@ -282,7 +706,7 @@ void *ui_server_thread(void *data) {
       }
     }
 
-    current_delay = (get_actual_delta(bc) * bc->period_time) / 1000;
+    current_delay = get_actual_delay_us(bc) / 1000;
     /* check for changes in current delay since report */
     if (abs(current_delay - last_current_delay) > 50) {
       ret = ui_send_current_delay(bc);
@@ -291,7 +715,19 @@ void *ui_server_thread(void *data) {
       }
     }
 
-    usleep(UI_SLEEP_TIME_MS * 1000);
+    /* check for recordings starting or stopping */
+    if (last_rec != recorder_status(bc, rec_name, sizeof(rec_name))) {
+      last_rec = ui_send_recorder(bc);
+    }
+
+    /* check for buffer memory changes (pages committed or released) */
+    if (now - last_mem_ms >= UI_MEM_CHECK_MS) {
+      if (abs((int)(ring_resident_bytes(bc) / 1024) - (int)last_mem_kb) >=
+          ELASTIC_CHUNK_BYTES / 1024) {
+        last_mem_kb = ui_send_memory(bc);
+      }
+      last_mem_ms = now;
+    }
   }
 
   return NULL;
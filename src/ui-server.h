@@ -1,7 +1,8 @@
 #ifndef __UI_SERVER_H
 #define __UI_SERVER_H
 
-int ui_init(buffer_config_t *bc);
+/* NULL or "" endpoints use the defaults (nojoebuck-client.h) */
+int ui_init(buffer_config_t *bc, const char *cmd, const char *status);
 int ui_cleanup(void);
 void *ui_server_thread(void *data);
 
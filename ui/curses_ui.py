@@ -1,17 +1,21 @@
 #!/usr/bin/env python3
 
 import curses
-import zmq
 import logging
+import sys
 import time
+from nojoebuck_client import Client
 
 BUF_Y = 5
-UI_CMD = "ipc:///tmp/nojobuck_cmd"
-UI_STATUS = "ipc:///tmp/nojobuck_status"
+LEVEL_Y = 15
+LEVEL_PERIOD_MS = 250
+QUERY_RETRY_S = 1.0   # seconds before repeating unanswered queries
 
 current_delay = 0
 delay_setting = 0
 buf = 0
+levels = []
+memory_kb = 0
 last_redraw = 0.0
 
 def buf_progress(stdscr):
@@ -88,6 +92,23 @@ def buf_progress(stdscr):
     stdscr.addstr(BUF_Y + 5, w - 5, "Over")
 
 
+def level_meters(stdscr):
+    global levels
+
+    stdscr.addstr(LEVEL_Y - 1, 2, "Capture Level (dBFS)")
+    # levels are peak,rms pairs per channel in 0.1 dBFS
+    for chan in range(int(len(levels) / 2)):
+        peak = levels[2 * chan] / 10.0
+        rms = levels[2 * chan + 1] / 10.0
+        w = curses.COLS - 32
+        # meter spans -60 to 0 dBFS
+        bar = int(((max(rms, -60.0) + 60.0) / 60.0) * w)
+        stdscr.move(LEVEL_Y + chan, 2)
+        stdscr.clrtoeol()
+        stdscr.addstr("%d: peak %6.1f rms %6.1f " % (chan, peak, rms))
+        if (bar > 0):
+            stdscr.addstr("#" * bar)
+
 def redraw(stdscr):
     global current_delay
     global delay_setting
@@ -104,70 +125,78 @@ def redraw(stdscr):
     stdscr.addstr(2, curses.COLS - 21,
                   "Current Delay: %.2f" % (current_delay/1000.0), curses.A_REVERSE)
     stdscr.clrtoeol()
+    stdscr.addstr(3, 2, "Buffer Memory: %.1f MB" % (memory_kb/1024.0))
+    stdscr.clrtoeol()
     buf_progress(stdscr);
+    level_meters(stdscr);
     stdscr.refresh()
 
-def main(stdscr):
+def handle(stdscr, status):
     global current_delay
     global delay_setting
     global buf
+    global levels
+    global memory_kb
+
+    logging.debug('Received message: "%s:%s"' % (status.type, status.text))
+    stdscr.addstr(12, 2, "Received message: %s:%s" % (status.type, status.text))
+    stdscr.clrtoeol()
+    if (status.type == "B"):
+        if (status.value != buf):
+            logging.debug('Parsed as new buff: %d' % (status.value))
+            buf = status.value
+            redraw(stdscr)
+    if (status.type == "D"):
+        if (status.value != delay_setting):
+            logging.debug('Parsed as new delay setting: %d' % (status.value))
+            delay_setting = status.value
+            redraw(stdscr)
+    if (status.type == "L"):
+        levels = status.levels
+        redraw(stdscr)
+    if (status.type == "M"):
+        memory_kb = status.value
+        redraw(stdscr)
+    if (status.type == "C"):
+        if (status.value != current_delay):
+            logging.debug('Parsed as new current delay: %d' % (status.value))
+            current_delay = status.value
+            redraw(stdscr)
+
+def main(stdscr):
+    global delay_setting
 
     logging.basicConfig(filename='log',level=logging.INFO)
 
-    socket_cmd = zmq.Context().socket(zmq.PUSH)
-    socket_cmd.connect (UI_CMD)
+    nj = Client()
+    nj.subscribe("") # subscribe to everything
+    # wake up for key presses as well as status
+    nj.set_wake_fd(sys.stdin.fileno())
 
-    socket_status = zmq.Context().socket(zmq.SUB)
-    socket_status.connect (UI_STATUS)
-    socket_status.setsockopt_string(zmq.SUBSCRIBE, "") # subscribe to everything
+    nj.set_level_period(LEVEL_PERIOD_MS)
+    for topic in "CDBM":
+        nj.query(topic)
 
     curses.curs_set(False)
     stdscr.nodelay(True)
     redraw(stdscr)
 
-    new_current_delay = current_delay
-    new_delay_setting = delay_setting
-    new_buf = buf
-
     while True:
-        if (current_delay == 0):
-            logging.debug('Current delay is 0; send CURRENT DELAY query');
-            socket_cmd.send(b"C:");
-        if (delay_setting == 0):
-            logging.debug('Delay setting is 0; send DELAY SETTING query');
-            socket_cmd.send(b"D:");
-        if (buf == 0):
-            logging.debug('Buffer is 0; send BUFFER query');
-            socket_cmd.send(b"B:");
-
-        message = ""
-        try:
-            message = socket_status.recv(flags=zmq.NOBLOCK).decode()
-        except zmq.ZMQError: 
-            pass
-        if (message != ""):
-            logging.debug('Received message: "%s"' % (message))
-            stdscr.addstr(12, 2, "Received message: %s" % (message))
-            stdscr.clrtoeol()
-            cmd = message.split(':');
-            if (cmd[0] == "B"):
-                new_buf = int(cmd[1])
-                if (new_buf != buf):
-                    logging.debug('Parsed as new buff: %d' % (new_buf))
-                    buf = new_buf
-                    redraw(stdscr)
-            if (cmd[0] == "D"):
-                new_delay_setting = int(cmd[1])
-                if (new_delay_setting != delay_setting):
-                    logging.debug('Parsed as new delay setting: %d' % (new_delay_setting))
-                    delay_setting = new_delay_setting
-                    redraw(stdscr)
-            if (cmd[0] == "C"):
-                new_current_delay = int(cmd[1])
-                if (new_current_delay != current_delay):
-                    logging.debug('Parsed as new current delay: %d' % (new_current_delay))
-                    current_delay = new_current_delay
-                    redraw(stdscr)
+        # sleep until there's a status message or a key press
+        status = nj.wait(QUERY_RETRY_S)
+        if (status):
+            handle(stdscr, status)
+        else:
+            # ask again for anything the server hasn't told us yet
+            if (current_delay == 0):
+                logging.debug('Current delay is 0; send CURRENT DELAY query');
+                nj.query("C")
+            if (delay_setting == 0):
+                logging.debug('Delay setting is 0; send DELAY SETTING query');
+                nj.query("D")
+            if (buf == 0):
+                logging.debug('Buffer is 0; send BUFFER query');
+                nj.query("B")
 
         ui_delay = delay_setting;
 
@@ -190,9 +219,13 @@ def main(stdscr):
         if (ui_delay < 0):
             ui_delay = 0
         if (ui_delay != delay_setting):
+            # shown right away; the server corrects it if out of range.
+            # Key repeats are coalesced by the client library
             logging.debug('Set new delay: %d' % (ui_delay))
-            socket_cmd.send(b"D:%d" % (ui_delay))
-        else:
-           time.sleep(0.05)
+            nj.set_delay(ui_delay)
+            delay_setting = ui_delay
+            redraw(stdscr)
+
+    nj.close()
 
 curses.wrapper(main)
@@ -5,16 +5,20 @@ import time
 import struct
 from smbus2 import SMBus, i2c_msg
 import logging
-import zmq
 import microdotphat
+from nojoebuck_client import Client
 #from seesaw import Seeaw
 from RPi import GPIO
 
-UI_CMD = "ipc:///tmp/nojobuck_cmd"
-UI_STATUS = "ipc:///tmp/nojobuck_status"
-
 REDRAW_PERIOD = 0.20      # seconds between redraws
+ENCODER_POLL = 0.05       # seconds to wait for status between encoder reads
 DELAY_MODE_TIMEOUT = 1.5  # seconds to leave delay_setting screen up
+LEVEL_PERIOD_MS = 500     # ms between capture level reports
+SIGNAL_DB = -600          # RMS level (0.1 dBFS) considered an audio signal
+NO_SIGNAL_DB = -900       # RMS level (0.1 dBFS) considered dead capture
+
+# encoder pixel colors for capture level: signal / quiet feed / no audio
+LEVEL_COLORS = [(0, 32, 0), (32, 16, 0), (32, 0, 0)]
 
 class Run:
   def __init__(self):
@@ -56,11 +60,21 @@ def show_delay_setting(delay):
     logging.debug('display delay_setting: %.2f' % (delay/ 1000.0))
     microdotphat.show()
 
+def level_color(levels):
+    # levels are peak,rms pairs per channel; use the loudest channel's rms
+    rms = max(levels[1::2])
+    if (rms > SIGNAL_DB):
+        return LEVEL_COLORS[0]
+    elif (rms > NO_SIGNAL_DB):
+        return LEVEL_COLORS[1]
+    return LEVEL_COLORS[2]
+
 def main():
     server_delay = -1 # last delay value sent/recieved from UI server
     server_buf = -1  # last buf value sent/recieved from UI server
     drawn_delay = -1 # last delay value drawn (higher priority than sent_delay)
     last_drawn_buf_val = -500
+    drawn_color = None
  
     r = Run();
     rotary = Seesaw();
@@ -69,31 +83,27 @@ def main():
                         format='%(asctime)s %(levelname)s %(message)s')
     logging.debug("Starting up %d" % (r.run))
 
-    socket_status = zmq.Context().socket(zmq.SUB)
-    socket_status.connect (UI_STATUS)
-    socket_status.setsockopt_string(zmq.SUBSCRIBE, "") # subscribe to everything
-
-    socket_cmd = zmq.Context().socket(zmq.PUSH)
-    socket_cmd.connect (UI_CMD)
+    nj = Client()
+    nj.subscribe("BDL")
 
     # query the current delay/buf before starting
     while (server_delay == -1 or server_buf == -1):
         logging.debug("Query delay & buf")
-        socket_cmd.send(b"D:");
-        socket_cmd.send(b"B:");
-
-        cmd = ['','']
-        try:
-            cmd = socket_status.recv(flags=zmq.NOBLOCK).decode().split(':')
-        except zmq.ZMQError: 
-            pass
-        if (cmd[0] == "D"):
-            server_delay = int(cmd[1]);
-            logging.debug('got delay_setting query response: %d' % (server_delay))
-        elif (cmd[0] == "B"):
-            server_buf = int(cmd[1]);
-            logging.debug('got buffer query response: %d' % (server_buf))
-        time.sleep(0.01)
+        nj.query("D")
+        nj.query("B")
+
+        status = nj.wait(0.5)
+        while (status):
+            if (status.type == "D"):
+                server_delay = status.value
+                logging.debug('got delay_setting query response: %d' % (server_delay))
+            elif (status.type == "B"):
+                server_buf = status.value
+                logging.debug('got buffer query response: %d' % (server_buf))
+            status = nj.wait(0)
+
+    # periodic capture level reports show signal presence on the encoder pixel
+    nj.set_level_period(LEVEL_PERIOD_MS)
 
     last_drawn_buf_time = time.time()
     show_delay_setting(server_delay)
@@ -129,25 +139,26 @@ def main():
         # Only send message when we're not getting rotations
         elif (new_delay_setting != server_delay):
             logging.debug('Send: D:%d' % (new_delay_setting))
-            socket_cmd.send(b"D:%d" % (new_delay_setting))
+            nj.set_delay(new_delay_setting)
             server_delay = new_delay_setting
             shouldSleep = False
             send_pending = False
 
-        message = ""
-        try:
-            message = socket_status.recv(flags=zmq.NOBLOCK).decode()
-        except zmq.ZMQError: 
-            pass
-
-        if (message != ""):
-            shouldSleep = False
-            cmd = message.split(':');
-            logging.debug('Received: {}'.format(cmd))
-            if (cmd[0] == "B"):
-                server_buf = int(cmd[1])
-            elif (cmd[0] == "D"):
-                server_delay = int(cmd[1])
+        # Sleep until there's status to show (or it's time to look at the
+        # encoder again) unless the encoder is moving
+        status = nj.wait(ENCODER_POLL if shouldSleep else 0)
+
+        if (status):
+            logging.debug('Received: {}:{}'.format(status.type, status.text))
+            if (status.type == "B"):
+                server_buf = status.value
+            elif (status.type == "D"):
+                server_delay = status.value
+            elif (status.type == "L"):
+                color = level_color(status.levels)
+                if (color != drawn_color):
+                    rotary.set_pixel(color)
+                    drawn_color = color
 
         now = time.time()
         # Only update display with server value if we have no pending UI change to send
@@ -169,11 +180,9 @@ def main():
             logging.debug('Drawing buf because new value')
             show_buf(server_buf)
             last_drawn_buf_val = server_buf
-            
-        if (shouldSleep):
-            time.sleep(0.01)
 
     # Clean up
+    nj.close()
     microdotphat.clear()
 
 
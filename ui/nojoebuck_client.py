@@ -0,0 +1,104 @@
+"""Python binding for libnojoebuck-client (see src/nojoebuck-client.h).
+
+Lets the UIs block until the server has something to show instead of
+polling the ZMQ sockets themselves:
+
+    nj = Client()
+    nj.subscribe("BD")
+    nj.query("D")
+    while True:
+        status = nj.wait()        # None on timeout or wake fd
+"""
+
+import ctypes
+
+MAX_MSG = 64
+MAX_LEVELS = 16
+
+
+class Status(ctypes.Structure):
+    _fields_ = [("topic", ctypes.c_int),
+                ("value", ctypes.c_int),
+                ("num_levels", ctypes.c_uint),
+                ("_levels", ctypes.c_int * MAX_LEVELS),
+                ("_text", ctypes.c_char * (MAX_MSG + 1))]
+
+    @property
+    def type(self):
+        """Topic letter, i.e. 'B', 'D' or 'L'"""
+        return chr(self.topic)
+
+    @property
+    def levels(self):
+        """Peak,rms pairs per channel in 0.1 dBFS ('L' only)"""
+        return list(self._levels[:self.num_levels])
+
+    @property
+    def text(self):
+        return self._text.decode()
+
+
+_lib = ctypes.CDLL("libnojoebuck-client.so")
+_lib.njb_open.restype = ctypes.c_void_p
+_lib.njb_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+_lib.njb_close.argtypes = [ctypes.c_void_p]
+_lib.njb_subscribe.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+_lib.njb_set_delay.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+_lib.njb_flush.argtypes = [ctypes.c_void_p]
+_lib.njb_query.argtypes = [ctypes.c_void_p, ctypes.c_int]
+_lib.njb_set_level_period.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+_lib.njb_set_rate_limit.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+_lib.njb_command.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+_lib.njb_set_wake_fd.argtypes = [ctypes.c_void_p, ctypes.c_int]
+_lib.njb_wait.argtypes = [ctypes.c_void_p, ctypes.c_int,
+                          ctypes.POINTER(Status)]
+
+
+class Client:
+    def __init__(self, cmd_endpoint=None, status_endpoint=None):
+        self._njb = _lib.njb_open(
+            cmd_endpoint.encode() if cmd_endpoint else None,
+            status_endpoint.encode() if status_endpoint else None)
+        if not self._njb:
+            raise RuntimeError("Could not connect to nojoebuck")
+
+    def close(self):
+        if self._njb:
+            _lib.njb_close(self._njb)
+            self._njb = None
+
+    def subscribe(self, topics=""):
+        """Topic letters to receive, i.e. "BDL", or "" for everything"""
+        return _lib.njb_subscribe(self._njb, topics.encode())
+
+    def set_delay(self, delay_ms):
+        """Coalesced: bursts send at most one change per 50 ms"""
+        return _lib.njb_set_delay(self._njb, int(delay_ms))
+
+    def flush(self):
+        return _lib.njb_flush(self._njb)
+
+    def query(self, topic):
+        return _lib.njb_query(self._njb, ord(topic))
+
+    def set_level_period(self, period_ms):
+        return _lib.njb_set_level_period(self._njb, int(period_ms))
+
+    def set_rate_limit(self, period_ms):
+        return _lib.njb_set_rate_limit(self._njb, int(period_ms))
+
+    def command(self, cmd):
+        return _lib.njb_command(self._njb, cmd.encode())
+
+    def set_wake_fd(self, fd):
+        """Also return from wait() when fd is readable (-1 to stop)"""
+        _lib.njb_set_wake_fd(self._njb, fd)
+
+    def wait(self, timeout=None):
+        """Block up to timeout seconds (None = forever) for a status"""
+        status = Status()
+        ms = -1 if timeout is None else int(timeout * 1000)
+        ret = _lib.njb_wait(self._njb, ms, ctypes.byref(status))
+        if ret < 0:
+            raise OSError(-ret, "nojoebuck client wait failed")
+        return status if ret > 0 else None